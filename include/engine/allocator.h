@@ -0,0 +1,39 @@
+#ifndef ENGINE_ALLOCATOR_H
+#define ENGINE_ALLOCATOR_H
+
+#include <stddef.h>
+
+#include "memory.h"
+
+/* Allocator interface for containers.
+ * Every function receives `ctx`, which lets a container allocate from a
+ * specific memory block or pool. Deallocation is told the size of the
+ * allocation, so sized allocators such as pools need no headers. */
+typedef struct allocator {
+  void* (*alloc)(void* ctx, size_t size);
+  void* (*realloc)(void* ctx, void* ptr, size_t old_size, size_t new_size);
+  void (*dealloc)(void* ctx, void* ptr, size_t size);
+  void* ctx;
+} allocator;
+
+/* Regular `malloc`, `realloc` and `free` */
+allocator allocator_malloc(void);
+
+/* Alignment of every allocation from `allocator_memory`, the same as the
+ * `_Alignof(max_align_t)` of `malloc` on 64-bit targets */
+#define ALLOCATOR_ALIGN 16
+
+/* Allocates from a memory block, aligned to `ALLOCATOR_ALIGN`. Deallocation
+ * is a no-op, everything is discarded at once when the memory block is
+ * cleared. */
+allocator allocator_memory(memory* mem);
+
+/* Allocates from a pool, see `memory_pool` */
+allocator allocator_pool(memory_pool* pool);
+
+#define allocator_alloc(a, size) ((a)->alloc((a)->ctx, size))
+#define allocator_realloc(a, ptr, old_size, new_size)                          \
+  ((a)->realloc((a)->ctx, ptr, old_size, new_size))
+#define allocator_dealloc(a, ptr, size) ((a)->dealloc((a)->ctx, ptr, size))
+
+#endif
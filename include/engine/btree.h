@@ -1,10 +1,16 @@
 #ifndef BTREE_H
 #define BTREE_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
+#include <sys/types.h>
+
+#include "allocator.h"
+
 #define BTREE_DEGREE_DEFAULT 4
 
+/* Bounds for the node sizes, in bytes, passed to `btree_degree_from_size` */
 #define BTREE_SIZE_MIN 8
 #define BTREE_SIZE_MAX 4096
 
@@ -12,9 +18,57 @@
 #define BTREE_CMP_EQ (0)
 #define BTREE_CMP_GT (1)
 
+/* Btree flags */
+/* B+tree mode: elements are only stored in the leaves, which are linked in
+ * order. Internal nodes hold copies of the first element of the subtree to
+ * their right as separators. Scans walk the leaf chain instead of the tree. */
+#define BTREE_PLUS (1 << 0)
+/* Concurrent read mode: writers are serialized by a latch and lock every node
+ * they modify, while readers using `btree_search_concurrent` traverse without
+ * locks and retry when a node version changed underneath them.
+ * Nodes removed by a writer are kept until `btree_reclaim`, which may only be
+ * called while no reader is active.
+ * `btree_search`, the typed lookups and the iterators do not validate, and
+ * are not safe while a writer is active. `cmp` may see a torn element during
+ * a concurrent write, whose result is discarded, so it must not crash on one.
+ */
+#define BTREE_CONCURRENT (1 << 1)
+
 struct btree;
 struct btree_iter_t;
 
+/* A node is a single allocation:
+ *
+ *   [struct btree_node][items: 2t * elem_size][children: (2t + 1) * node*]
+ *
+ * Leaf nodes have no children array. Keeping everything in one block means a
+ * lookup touches one contiguous region per level instead of chasing separate
+ * pointers to the items and the children.
+ * In a B+tree, leaves have two children slots holding the previous and the
+ * next leaf, at `BTREE_LEAF_PREV` and `BTREE_LEAF_NEXT`.
+ * The layout is public so `DEFINE_BTREE` can generate typed lookups. */
+struct btree_node {
+  ssize_t n; /* number of items/keys/elements */
+  ssize_t c; /* number of children */
+  ssize_t count; /* number of elements in this subtree */
+  bool leaf;
+  unsigned int version; /* odd while a writer holds the node */
+};
+
+/* Rounds `x` up to a multiple of `a` */
+#define BTREE_ALIGN(x, a) ((x) + ((a) - (x) % (a)) % (a))
+
+/* Items start right after the header, aligned for any element type */
+#define BTREE_NODE_HEADER_SIZE BTREE_ALIGN(sizeof(struct btree_node), 16)
+
+#define btree_node_items(x) ((unsigned char*)(x) + BTREE_NODE_HEADER_SIZE)
+/* `children_offset` is given by `btree_children_offset` */
+#define btree_node_children(x, children_offset)                                \
+  ((struct btree_node**)((unsigned char*)(x) + (children_offset)))
+
+#define BTREE_LEAF_PREV 0
+#define BTREE_LEAF_NEXT 1
+
 /* elem_size: the size of the elements, typically `sizeof(struct <your struct>)`
  * t: degree of the btree, if you're in doubt, use `BTREE_SIZE_DEFAULT`
  * cmp: comparison function, in order to support any operations on the tree.
@@ -26,29 +80,223 @@ struct btree* btree_new(size_t elem_size, size_t t,
                         int (*cmp)(const void* a, const void* b));
 
 /* Same as `btree_new`, except that it actually initializes a btree, but with
- * the given allocators.
+ * the given allocator. The tree keeps a copy of `alloc`.
+ * Using `allocator_memory` puts the whole tree in a memory block, where it can
+ * be discarded by clearing the block instead of calling `btree_free`.
  */
 struct btree* btree_new_with_allocator(size_t elem_size, size_t t,
                                        int (*cmp)(const void* a, const void* b),
-                                       void* (*alloc)(size_t),
-                                       void (*dealloc)(void*));
+                                       const allocator* alloc);
+
+/* Same as `btree_new_with_allocator`, but with `BTREE_*` flags */
+struct btree* btree_new_ex(size_t elem_size, size_t t,
+                           int (*cmp)(const void* a, const void* b),
+                           const allocator* alloc, int flags);
+
+/* Returns the largest degree for which an internal node of a tree with
+ * elements of `elem_size` fits in `node_size` bytes, but at least 2.
+ * Each node, including its items and children, is a single allocation, so
+ * a multiple of the cache line (64, 256) or a page (4096) keeps lookups to a
+ * few contiguous lines per level.
+ * `node_size` is clamped to `BTREE_SIZE_MIN`..`BTREE_SIZE_MAX`. */
+size_t btree_degree_from_size(size_t elem_size, size_t node_size);
 
 void btree_free(struct btree** btree);
 
 void* btree_search(struct btree* btree, void* elem);
+/* Looks up `elem` in a `BTREE_CONCURRENT` tree while other threads may write
+ * to it, and copies the found element into `out`.
+ * returnvalue: true if an element equal to `elem` was found */
+bool btree_search_concurrent(struct btree* btree, const void* elem, void* out);
+/* Frees the nodes removed since the last call. No `btree_search_concurrent`
+ * may be running. Does nothing unless the tree is `BTREE_CONCURRENT`. */
+void btree_reclaim(struct btree* btree);
 void btree_insert(struct btree* btree, void* elem);
+/* Deletes an element equal to `elem`, which must not point into the tree.
+ * returnvalue: 1 if an element was deleted, 0 if none was found */
 int btree_delete(struct btree* btree, void* elem);
 
+/* Builds the tree from `n` elements sorted by the trees comparison function.
+ * The nodes are packed bottom-up in linear time, instead of splitting them
+ * one insertion at a time. The elements are inserted one by one into a
+ * non-empty tree. */
+void btree_bulk_load(struct btree* btree, const void* sorted, size_t n);
+
+/* Inserts or deletes `n` elements in any order. The elements are sorted
+ * first, so consecutive operations walk mostly the same path, and a batch
+ * into an empty tree is a bulk load.
+ * returnvalue: `btree_delete_batch` returns the number of deleted elements */
+void btree_insert_batch(struct btree* btree, const void* elems, size_t n);
+size_t btree_delete_batch(struct btree* btree, const void* elems, size_t n);
+
 void btree_print(struct btree* btree, void (*print_elem)(const void*));
 
 void* btree_first(struct btree* btree);
 void* btree_last(struct btree* btree);
 
+/* Number of elements in the tree, in O(1) */
 size_t btree_size(struct btree* btree);
 
+/* Order statistics, in O(t log n) using the per-node subtree counts */
+/* Number of elements less than `elem` */
+size_t btree_rank(struct btree* btree, const void* elem);
+/* The `k`th smallest element counting from 0, NULL if `k` is out of range */
+void* btree_select(struct btree* btree, size_t k);
+
+size_t btree_height(struct btree* btree);
+
+/* Node access, for typed lookups. All of them accept a NULL tree */
+struct btree_node* btree_root(struct btree* btree);
+size_t btree_children_offset(struct btree* btree);
+int btree_flags(struct btree* btree);
+
+/* Binary searches the items of `x` for `key`.
+ * returnvalue: the index of the first item that is not less than `key`, or
+ * with `upper`, the index of the first item that is greater than `key` */
+typedef ssize_t (*btree_bound_fn)(const struct btree_node* x, const void* key,
+                                  bool upper);
+
+/* Makes every operation on `btree` search its nodes with `bound`, which must
+ * agree with the comparison function of the tree. Each node then costs one
+ * call through a pointer, instead of one per comparison. */
+void btree_set_bound(struct btree* btree, btree_bound_fn bound);
+
+/* Iterators are cursors between two elements, sized by the height of the
+ * tree. They are invalidated by inserting into or deleting from the tree. */
+
+/* Creates an iterator before the first element */
 struct btree_iter_t* btree_iter_t_new(struct btree* tree);
+/* Creates an iterator before the first element not less than `elem` */
+struct btree_iter_t* btree_lower_bound(struct btree* tree, const void* elem);
+/* Creates an iterator before the first element greater than `elem` */
+struct btree_iter_t* btree_upper_bound(struct btree* tree, const void* elem);
+
+void btree_iter_t_free(struct btree* tree, struct btree_iter_t** it);
+/* Moves the iterator before the first element, or after the last element.
+ * `*it` is reallocated if the tree has grown taller. */
 void btree_iter_t_reset(struct btree* tree, struct btree_iter_t** it);
+void btree_iter_t_reset_end(struct btree* tree, struct btree_iter_t** it);
 
+/* Returns the element after the cursor and moves past it, NULL at the end */
 void* btree_iter(struct btree* tree, struct btree_iter_t* iter);
+/* Returns the element before the cursor and moves back past it, or NULL at
+ * the start */
+void* btree_iter_prev(struct btree* tree, struct btree_iter_t* iter);
+/* Same as `btree_iter`, but returns NULL once the element is not less than
+ * `end`. Together with `btree_lower_bound` this scans [from, end):
+ *
+ *   it = btree_lower_bound(tree, &from);
+ *   while ((e = btree_iter_until(tree, it, &end)) != NULL) ...
+ */
+void* btree_iter_until(struct btree* tree, struct btree_iter_t* iter,
+                       const void* end);
+
+/* Less-than for scalar keys, for use with `DEFINE_BTREE` */
+#define BTREE_LT(a, b) ((a) < (b))
+
+/* Defines a btree of `type`, where `lt(a, b)` compares two values of `type`
+ * Example: DEFINE_BTREE(u64, BTREE_LT)
+ *
+ * Lookups binary search each node with `lt` inlined, instead of calling the
+ * comparison function through a pointer for every key. Modifications go
+ * through the generic btree, which searches each node with the same inlined
+ * binary search, see `btree_set_bound`.
+ * Trees made with `btree_<type>_new` are ordinary btrees, so every `btree_*`
+ * function can be used on them too. */
+#define DEFINE_BTREE(type, lt)                                                 \
+  static inline int btree_##type##_cmp(const void* a, const void* b) {         \
+    const type x = *(const type*)a;                                            \
+    const type y = *(const type*)b;                                            \
+    if (lt(x, y)) return BTREE_CMP_LT;                                         \
+    if (lt(y, x)) return BTREE_CMP_GT;                                         \
+    return BTREE_CMP_EQ;                                                       \
+  }                                                                            \
+                                                                               \
+  static inline ssize_t btree_##type##_bound(const struct btree_node* x,      \
+                                             const void* key, bool upper) {    \
+    const type* items = (const type*)btree_node_items(x);                      \
+    const type k = *(const type*)key;                                          \
+    ssize_t lo = 0;                                                            \
+    ssize_t hi = x->n;                                                         \
+    while (lo < hi) {                                                          \
+      const ssize_t mid = lo + (hi - lo) / 2;                                  \
+      if (upper ? !lt(k, items[mid]) : lt(items[mid], k))                      \
+        lo = mid + 1;                                                          \
+      else                                                                     \
+        hi = mid;                                                              \
+    }                                                                          \
+    return lo;                                                                 \
+  }                                                                            \
+                                                                               \
+  /* `alloc` can be NULL to use `allocator_malloc` */                          \
+  static inline struct btree* btree_##type##_new_ex(                           \
+      size_t t, const allocator* alloc, int flags) {                           \
+    const allocator a = alloc == NULL ? allocator_malloc() : *alloc;           \
+    struct btree* tree =                                                       \
+        btree_new_ex(sizeof(type), t, &btree_##type##_cmp, &a, flags);         \
+    btree_set_bound(tree, &btree_##type##_bound);                              \
+    return tree;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline struct btree* btree_##type##_new(size_t t,                     \
+                                                 const allocator* alloc) {     \
+    return btree_##type##_new_ex(t, alloc, 0);                                 \
+  }                                                                            \
+                                                                               \
+  static inline type* btree_##type##_search(struct btree* tree,                \
+                                            const type key) {                  \
+    struct btree_node* x = btree_root(tree);                                   \
+    const size_t children_offset = btree_children_offset(tree);                \
+    const int plus = btree_flags(tree) & BTREE_PLUS;                           \
+                                                                               \
+    while (x != NULL) {                                                        \
+      type* items = (type*)btree_node_items(x);                                \
+      ssize_t lo = btree_##type##_bound(x, &key, false);                       \
+      if (plus && x->leaf && lo == x->n) {                                     \
+        /* The lower bound is the first element of the next leaf */            \
+        x = btree_node_children(x, children_offset)[BTREE_LEAF_NEXT];          \
+        if (x == NULL) return NULL;                                            \
+        items = (type*)btree_node_items(x);                                    \
+        lo = 0;                                                                \
+      }                                                                        \
+      /* B+tree separators are only copies */                                  \
+      if ((x->leaf || !plus) && lo < x->n && !lt(key, items[lo])) {            \
+        return &items[lo];                                                     \
+      }                                                                        \
+      if (x->leaf) return NULL;                                                \
+      x = btree_node_children(x, children_offset)[lo];                         \
+    }                                                                          \
+    return NULL;                                                               \
+  }                                                                            \
+                                                                               \
+  static inline void btree_##type##_insert(struct btree* tree,                 \
+                                           const type key) {                   \
+    type tmp = key;                                                            \
+    btree_insert(tree, &tmp);                                                  \
+  }                                                                            \
+                                                                               \
+  static inline int btree_##type##_delete(struct btree* tree,                  \
+                                          const type key) {                    \
+    type tmp = key;                                                            \
+    return btree_delete(tree, &tmp);                                           \
+  }                                                                            \
+                                                                               \
+  static inline struct btree_iter_t* btree_##type##_lower_bound(               \
+      struct btree* tree, const type key) {                                    \
+    return btree_lower_bound(tree, &key);                                      \
+  }                                                                            \
+                                                                               \
+  static inline struct btree_iter_t* btree_##type##_upper_bound(               \
+      struct btree* tree, const type key) {                                    \
+    return btree_upper_bound(tree, &key);                                      \
+  }                                                                            \
+                                                                               \
+  static inline type* btree_##type##_first(struct btree* tree) {               \
+    return (type*)btree_first(tree);                                           \
+  }                                                                            \
+                                                                               \
+  static inline type* btree_##type##_last(struct btree* tree) {                \
+    return (type*)btree_last(tree);                                            \
+  }
 
 #endif
@@ -20,6 +20,14 @@ typedef struct {
 typedef struct Window Window;
 
 #define NUM_GLOBAL_BINDINGS 1
+
+/* Size of the per-frame scratch memory, see `memory_frame` */
+#define FRAME_MEMORY_SIZE (16 * 1024 * 1024)
+
+/* Engine flag for `engine_init`, in a bit unused by `SDL_WindowFlags`.
+ * Backs the state memory with transparent huge pages where available. */
+#define ENGINE_FLAG_HUGEPAGES 0x80000000
+
 typedef struct {
   void* data; /* Contains textures and such */
   u64 data_len;
@@ -47,6 +55,7 @@ typedef struct {
   usize edit_pos;
 
   memory* mem;
+  memory* frame_mem; /* Rewound at the start of every frame */
 
   i_ctx** bindings;
   usize bindings_sz;
@@ -56,6 +65,10 @@ typedef struct {
 } Platform;
 
 /* Essential functions */
+
+/* `initial_memory` is the largest amount of memory a state can use. It is only
+ * reserved, so physical memory follows what the states actually allocate.
+ * `flags` are `SDL_WindowFlags`, optionally or'ed with `ENGINE_FLAG_*`. */
 Platform* engine_init(const char* windowtitle, v2_i32 windowsize,
                       const f32 render_scale, const u32 flags,
                       const usize initial_memory, const Asset_FontSpec* fonts[],
@@ -8,14 +8,80 @@
 /* `fov_shadowcast`: */
 /*   map:         your 2D enum tile grid
  *   mapsize:     x: width, y: height of the map
- *   visblocking: pointer to a function that returns `true` when receiving a
- *                pointer to a LOS blocking tile
+ *   visblocking: pointer to a function that receives a pointer to a tile, and
+ *                returns `true` when light passes through it
  *   lightmap:    [out] 2D lightmap, this is simply overwritten with the
- * distance to the source. range:       visibility range/radius. src:         2D
- * point to calculate FOV from
+ *                distance to the source.
+ *   range:       visibility range/radius.
+ *   src:         2D point to calculate FOV from
+ * Tiles outside the map block light.
  *   */
 void fov_shadowcast(const void* map, const v2_i32 mapsize,
                     bool (*visblocking)(const void*), i32* lightmap,
                     const i32 range, v2_i32 src);
 
+/* How `fov_shadowcast_ex` reads the opacity of a tile */
+typedef enum fov_opacity_type {
+  /* `visblocking` is called on the tile, as in `fov_shadowcast` */
+  FOV_OPACITY_CALLBACK = 0,
+  /* One bit per tile, a set bit is an opaque tile. Bit x % 8 of byte x / 8 of
+   * a row holds tile x. */
+  FOV_OPACITY_BITS,
+  /* One byte per tile, a nonzero byte is an opaque tile. With `elem_size`
+   * larger than 1 this reads a single byte of each tile, eg. a flag in a tile
+   * struct when `data` points to that flag in the first tile. */
+  FOV_OPACITY_BYTES,
+} fov_opacity_type;
+
+/* Describes the opacity of the tiles of a map. Tile (x, y) starts at
+ *   data + y * stride + x * elem_size
+ * or at bit x of the row at data + y * stride for `FOV_OPACITY_BITS`. */
+typedef struct fov_opacity {
+  fov_opacity_type type;
+  const void* data;
+  usize stride;    /* bytes from one row to the next */
+  usize elem_size; /* bytes per tile, unused by `FOV_OPACITY_BITS` */
+  bool (*visblocking)(const void*); /* `FOV_OPACITY_CALLBACK` only */
+} fov_opacity;
+
+/* Bytes per row of a `FOV_OPACITY_BITS` map `width` tiles wide */
+#define FOV_BITS_STRIDE(width) (((usize)(width) + 7) / 8)
+
+/* Same as `fov_shadowcast`, but reads the opacity of tiles as described by
+ * `opacity`. Bits and bytes are tested inline, instead of calling a function
+ * for every tile. */
+void fov_shadowcast_ex(const fov_opacity* opacity, const v2_i32 mapsize,
+                       i32* lightmap, const i32 range, v2_i32 src);
+
+/* `fov_lightmap_multi`: lights `lightmap` from many sources at once */
+/*   opacity:  opacity of the tiles, see `fov_shadowcast_ex`
+ *   mapsize:  x: width, y: height of the map
+ *   sources:  [n] 2D points to calculate FOV from
+ *   ranges:   [n] visibility range/radius of each source
+ *   n:        number of sources
+ *   lightmap: [in, out] 2D lightmap, every tile is set to the largest of its
+ *             value and the light it receives from each source.
+ * Sources are split across a pool of threads, each lighting a lightmap of its
+ * own, which are then merged into `lightmap`. Few sources are lit on the
+ * calling thread. The threads are started by the first call that needs them,
+ * and kept until `fov_threads_stop`.
+ * Unlike calling `fov_shadowcast_ex` per source, a source never lowers the
+ * light of the tile it stands on.
+ * With `FOV_OPACITY_CALLBACK`, `visblocking` is called from several threads at
+ * once, so it must be safe to call concurrently. `fov_lightmap_multi` itself
+ * must only be called from one thread at a time.
+ *   */
+void fov_lightmap_multi(const fov_opacity* opacity, const v2_i32 mapsize,
+                        const v2_i32* sources, const i32* ranges, usize n,
+                        i32* lightmap);
+
+/* Stops the threads of `fov_lightmap_multi` and frees their lightmaps. The
+ * next call starts them again. */
+void fov_threads_stop(void);
+
+/* Stops the threads and frees everything the FOV functions keep between
+ * calls, like the tables of offsets built once per range. None of them may
+ * be running. */
+void fov_free(void);
+
 #endif
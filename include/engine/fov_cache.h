@@ -0,0 +1,49 @@
+#ifndef ENGINE_FOV_CACHE_H
+#define ENGINE_FOV_CACHE_H
+
+#include "fov.h"
+#include "types.h"
+#include "vector.h"
+
+/* FOV cache
+ *
+ * Keeps the lightmaps of recent (source, range) pairs of a map, so asking
+ * again for the FOV of a viewer that did not move costs a hash lookup instead
+ * of a shadowcast.
+ * The cache does not watch the map: whenever the opacity of a tile changes,
+ * call `fov_cache_mark_dirty`, which only drops the lightmaps whose radius
+ * covers that tile. `fov_cache_invalidate` drops all of them at once, eg. when
+ * a whole new level is loaded. Each of these bumps the revision of the map.
+ * Once full, the least recently used lightmap is replaced. */
+
+typedef struct fov_cache fov_cache;
+
+/* `fov_cache_new`: */
+/*   opacity:  opacity of the tiles, see `fov_shadowcast_ex`. It is copied,
+ *             but `opacity->data` has to outlive the cache.
+ *   mapsize:  x: width, y: height of the map
+ *   capacity: number of lightmaps kept, each of mapsize.x * mapsize.y tiles
+ *   */
+fov_cache* fov_cache_new(const fov_opacity* opacity, const v2_i32 mapsize,
+                         usize capacity);
+
+void fov_cache_free(fov_cache** cache);
+
+/* Returns the lightmap of `src` with `range`, computing it first if it is not
+ * cached. Tiles that are not visible are 0, as after a `fov_shadowcast_ex` on
+ * a lightmap cleared to 0.
+ * The lightmap belongs to the cache, and is only valid until the next call
+ * to any `fov_cache_*` function on this cache. */
+const i32* fov_cache_get(fov_cache* cache, const v2_i32 src, const i32 range);
+
+/* Tells the cache that the opacity of the tile at `tile` changed */
+void fov_cache_mark_dirty(fov_cache* cache, const v2_i32 tile);
+
+/* Tells the cache that the opacity of any tile may have changed */
+void fov_cache_invalidate(fov_cache* cache);
+
+/* Returns the revision of the map, bumped on every change of opacity reported
+ * to the cache */
+u64 fov_cache_revision(const fov_cache* cache);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef ENGINE_HASH_H
+#define ENGINE_HASH_H
+
+#include "types.h"
+
+#include <stddef.h>
+
+/* Seed used by the unseeded variants */
+#define HASH_SEED_DEFAULT 0
+
+/* Finalizer of splitmix64: a bijection on 64 bits where every input bit
+ * affects every output bit. Use it for integers and pointers, which usually
+ * differ in only a few low bits. */
+static inline u64 hash_mix64(u64 x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static inline u64 hash_u64_seeded(u64 x, u64 seed) {
+  return hash_mix64(x ^ hash_mix64(seed + 0x9e3779b97f4a7c15ULL));
+}
+
+static inline u64 hash_u64(u64 x) {
+  return hash_u64_seeded(x, HASH_SEED_DEFAULT);
+}
+
+static inline u64 hash_ptr(const void* ptr) { return hash_u64((u64)ptr); }
+
+/* Hashes `len` bytes, 16 to 48 bytes at a time (wyhash).
+ * The result depends on the byte order of the machine. */
+u64 hash_bytes_seeded(const void* data, usize len, u64 seed);
+u64 hash_bytes(const void* data, usize len);
+
+/* Hashes a NUL-terminated string, without the terminator */
+u64 hash_str_seeded(const char* str, u64 seed);
+u64 hash_str(const char* str);
+
+#endif
@@ -3,52 +3,368 @@
 
 #include "types.h"
 
-#include "list.h"
+#include "allocator.h"
+#include "hash.h"
 #include "memory.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 i32 lolhash(const usize s, i32 v);
 
-/* Define a linked list before using this */
-/* Example: DEFINE_LLIST(i32) */
-#define DEFINE_HASHMAP(type, lsize, cmp, type_to_int)                          \
-  typedef DEFINE_LLIST(type);                                                  \
+/* Capacity of a hashmap on its first insertion, always a power of two */
+#define HASHMAP_INITIAL_CAPACITY 16
+
+/* The table grows once it is more than LOAD_NUM/LOAD_DEN full */
+#define HASHMAP_LOAD_NUM 7
+#define HASHMAP_LOAD_DEN 8
+
+/* Probe distances are stored in a byte per slot, 0 marks an empty slot.
+ * Distances from `HASHMAP_DIST_MAX` on are stored as `HASHMAP_DIST_MAX`, and
+ * recomputed from the hash when they are needed. */
+#define HASHMAP_DIST_MAX 255
+
+/* Stats */
+
+/* Number of buckets of the probe length histogram, longer probes are counted
+ * in the last bucket */
+#define HASHMAP_STATS_HIST 16
+
+/* Counted on every lookup once enabled with `hashmap_<type>_stats_enable` */
+typedef struct hashmap_counters {
+  usize lookups;    /* lookups, including those of inserts and deletes */
+  usize probes;     /* slots visited by those lookups */
+  usize max_probes; /* most slots visited by a single lookup */
+} hashmap_counters;
+
+/* A snapshot of a hashmap, see `hashmap_<type>_stats`.
+ * The probe length of an element is the number of slots a lookup of it visits,
+ * 1 if it is in the slot it hashed to. */
+typedef struct hashmap_stats {
+  usize size;
+  usize capacity;
+  f32 load_factor;
+  usize resizes;
+  f32 avg_probe; /* average probe length of the elements */
+  usize max_probe;
+  usize hist[HASHMAP_STATS_HIST]; /* elements by probe length - 1 */
+  /* Zero unless enabled */
+  usize lookups;
+  usize probes;
+  usize max_lookup_probes;
+} hashmap_stats;
+
+static inline void hashmap_counters_record(hashmap_counters* c, usize probes) {
+  c->lookups++;
+  c->probes += probes;
+  if (probes > c->max_probes) c->max_probes = probes;
+}
+
+/* Logs the stats of a hashmap, `name` identifies it in the log */
+void hashmap_stats_log(const hashmap_stats* stats, const char* name);
+
+/* Defines an open-addressing hashmap of `type`, using Robin Hood hashing.
+ * cmp: `int cmp(const type* a, const type* b)`, returns 0 if a equals b
+ * hash: `u64 hash(const type* a)`, equal elements must hash equal, see
+ *       engine/hash.h. The low bits pick the slot, so they have to be mixed.
+ * Example:
+ *   static int entity_cmp(const entity* a, const entity* b) {
+ *     return a->id != b->id;
+ *   }
+ *   static u64 entity_hash(const entity* e) { return hash_u64(e->id); }
+ *   DEFINE_HASHMAP(entity, entity_cmp, entity_hash)
+ *
+ * Every slot stores the distance of its element to the slot it hashed to.
+ * Inserting takes the slot of any element closer to its own slot, which keeps
+ * probe sequences short, and lets a lookup stop as soon as it passes elements
+ * closer to home than the element it looks for. Deleting shifts the following
+ * elements back instead of leaving tombstones.
+ * The elements and their distances are a single allocation from the
+ * allocator given to `hashmap_<type>_init`.
+ *
+ * Pointers to elements are invalidated by inserting into or deleting from the
+ * hashmap.
+ *
+ * `hashmap_<type>_stats` reports the load factor and probe lengths of a
+ * hashmap, which catches poorly distributed keys. Counting lookups costs a
+ * NULL check per lookup until it is enabled. */
+#define DEFINE_HASHMAP(type, cmp, hash)                                        \
   typedef struct hashmap_##type {                                              \
-    usize size;                                                                \
-    List_##type elems[64];                                                     \
+    allocator alloc;                                                           \
+    usize capacity; /* number of slots, a power of two or 0 */                 \
+    usize size;     /* number of elements */                                   \
+    type* elems;                                                               \
+    u8* dist; /* probe distance + 1 of each slot, 0 if empty */                \
+    usize resizes;                                                             \
+    hashmap_counters* counters; /* NULL unless stats are enabled */            \
   } hashmap_##type;                                                            \
                                                                                \
-  type* hashmap_##type##_lookup(hashmap_##type* hmap, const type* val) {       \
-    const i32 idx = lolhash(64, type_to_int(val));                             \
-    List_##type* head = &hmap->elems[idx];                                     \
-    while (head != NULL) {                                                     \
-      if (!cmp(&(head->value), val)) return &(head->value);                    \
-      head = head->next;                                                       \
+  /* `alloc` can be NULL to use `allocator_malloc` */                          \
+  static inline void hashmap_##type##_init(hashmap_##type* hmap,               \
+                                           const allocator* alloc) {           \
+    hmap->alloc = alloc == NULL ? allocator_malloc() : *alloc;                 \
+    hmap->capacity = 0;                                                        \
+    hmap->size = 0;                                                            \
+    hmap->elems = NULL;                                                        \
+    hmap->dist = NULL;                                                         \
+    hmap->resizes = 0;                                                         \
+    hmap->counters = NULL;                                                     \
+  }                                                                            \
+                                                                               \
+  static inline void hashmap_##type##_free(hashmap_##type* hmap) {             \
+    if (hmap->elems != NULL) {                                                 \
+      allocator_dealloc(&hmap->alloc, hmap->elems,                             \
+                        hmap->capacity * (sizeof(type) + 1));                  \
+    }                                                                          \
+    if (hmap->counters != NULL) {                                              \
+      allocator_dealloc(&hmap->alloc, hmap->counters,                          \
+                        sizeof(hashmap_counters));                             \
+    }                                                                          \
+    hmap->capacity = 0;                                                        \
+    hmap->size = 0;                                                            \
+    hmap->elems = NULL;                                                        \
+    hmap->dist = NULL;                                                         \
+    hmap->resizes = 0;                                                         \
+    hmap->counters = NULL;                                                     \
+  }                                                                            \
+                                                                               \
+  /* returnvalue: the probe distance + 1 of the element in slot `i` */         \
+  static inline usize hashmap_##type##_dist(const hashmap_##type* hmap,        \
+                                            usize i) {                         \
+    if (hmap->dist[i] < HASHMAP_DIST_MAX) return hmap->dist[i];                \
+    return ((i - hash(&hmap->elems[i])) & (hmap->capacity - 1)) + 1;           \
+  }                                                                            \
+                                                                               \
+  static inline void hashmap_##type##_set_dist(hashmap_##type* hmap, usize i,  \
+                                               usize d) {                      \
+    hmap->dist[i] = d < HASHMAP_DIST_MAX ? d : HASHMAP_DIST_MAX;               \
+  }                                                                            \
+                                                                               \
+  /* Places `val`, which must not be in the hashmap yet, into a free slot.     \
+   * returnvalue: where `val` was placed */                                    \
+  static inline type* hashmap_##type##_place(hashmap_##type* hmap, type val) { \
+    const usize mask = hmap->capacity - 1;                                     \
+    usize i = hash(&val) & mask;                                               \
+    usize d = 1;                                                               \
+    type* placed = NULL;                                                       \
+                                                                               \
+    for (;;) {                                                                 \
+      if (hmap->dist[i] == 0) {                                                \
+        hmap->elems[i] = val;                                                  \
+        hashmap_##type##_set_dist(hmap, i, d);                                 \
+        hmap->size++;                                                          \
+        return placed != NULL ? placed : &hmap->elems[i];                      \
+      }                                                                        \
+      if (hmap->dist[i] < d && hashmap_##type##_dist(hmap, i) < d) {           \
+        /* Take the slot, and continue with the element that was closer */     \
+        const type tmp = hmap->elems[i];                                       \
+        const usize tmp_d = hashmap_##type##_dist(hmap, i);                    \
+        hmap->elems[i] = val;                                                  \
+        hashmap_##type##_set_dist(hmap, i, d);                                 \
+        if (placed == NULL) placed = &hmap->elems[i];                          \
+        val = tmp;                                                             \
+        d = tmp_d;                                                             \
+      }                                                                        \
+      i = (i + 1) & mask;                                                      \
+      d++;                                                                     \
+    }                                                                          \
+  }                                                                            \
+  /* Rehashes every element into a table of `capacity` slots.                  \
+   * returnvalue: false if the table could not be allocated, in which case     \
+   * the hashmap is unchanged */                                               \
+  static inline bool hashmap_##type##_resize(hashmap_##type* hmap,             \
+                                             usize capacity) {                 \
+    type* old_elems = hmap->elems;                                             \
+    u8* old_dist = hmap->dist;                                                 \
+    const usize old_capacity = hmap->capacity;                                 \
+    type* elems =                                                              \
+        allocator_alloc(&hmap->alloc, capacity * (sizeof(type) + 1));          \
+    usize i;                                                                   \
+                                                                               \
+    if (elems == NULL) {                                                       \
+      perror("could not grow hashmap");                                        \
+      return false;                                                            \
+    }                                                                          \
+                                                                               \
+    hmap->elems = elems;                                                       \
+    hmap->dist = (u8*)(elems + capacity);                                      \
+    hmap->capacity = capacity;                                                 \
+    hmap->size = 0;                                                            \
+    if (old_elems != NULL) hmap->resizes++;                                    \
+    memset(hmap->dist, 0, capacity);                                           \
+                                                                               \
+    for (i = 0; i < old_capacity; i++) {                                       \
+      if (old_dist[i] != 0) hashmap_##type##_place(hmap, old_elems[i]);        \
+    }                                                                          \
+                                                                               \
+    if (old_elems != NULL) {                                                   \
+      allocator_dealloc(&hmap->alloc, old_elems,                               \
+                        old_capacity * (sizeof(type) + 1));                    \
+    }                                                                          \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  /* Grows the table to hold at least `n` elements without resizing */         \
+  static inline bool hashmap_##type##_reserve(hashmap_##type* hmap, usize n) { \
+    usize capacity = HASHMAP_INITIAL_CAPACITY;                                 \
+    while (capacity * HASHMAP_LOAD_NUM < n * HASHMAP_LOAD_DEN) capacity *= 2;  \
+    if (capacity <= hmap->capacity) return true;                               \
+    return hashmap_##type##_resize(hmap, capacity);                            \
+  }                                                                            \
+                                                                               \
+  /* returnvalue: the slot holding an element equal to `val`, or -1 */         \
+  static inline isize hashmap_##type##_find(const hashmap_##type* hmap,        \
+                                            const type* val) {                 \
+    usize mask, i;                                                             \
+    usize d = 1;                                                               \
+    isize found = -1;                                                          \
+                                                                               \
+    if (hmap->size == 0) return -1;                                            \
+                                                                               \
+    mask = hmap->capacity - 1;                                                 \
+    i = hash(val) & mask;                                                      \
+    /* Past an element closer to its slot, `val` would have taken its place */ \
+    while (hmap->dist[i] != 0) {                                               \
+      const usize di = hashmap_##type##_dist(hmap, i);                         \
+      if (di < d) break;                                                       \
+      if (di == d && !cmp(&hmap->elems[i], val)) {                             \
+        found = i;                                                             \
+        break;                                                                 \
+      }                                                                        \
+      i = (i + 1) & mask;                                                      \
+      d++;                                                                     \
+    }                                                                          \
+                                                                               \
+    if (hmap->counters != NULL) hashmap_counters_record(hmap->counters, d);    \
+    return found;                                                              \
+  }                                                                            \
+                                                                               \
+  static inline type* hashmap_##type##_lookup(const hashmap_##type* hmap,      \
+                                              const type* val) {               \
+    const isize i = hashmap_##type##_find(hmap, val);                          \
+    return i < 0 ? NULL : &hmap->elems[i];                                     \
+  }                                                                            \
+                                                                               \
+  /* Inserts `val`, or overwrites an element equal to it.                      \
+   * returnvalue: the element in the hashmap, or NULL if out of memory */      \
+  static inline type* hashmap_##type##_insert(hashmap_##type* hmap,            \
+                                              const type* val) {               \
+    type* e = hashmap_##type##_lookup(hmap, val);                              \
+                                                                               \
+    if (e != NULL) {                                                           \
+      *e = *val;                                                               \
+      return e;                                                                \
+    }                                                                          \
+                                                                               \
+    if ((hmap->size + 1) * HASHMAP_LOAD_DEN >                                  \
+        hmap->capacity * HASHMAP_LOAD_NUM) {                                   \
+      const usize capacity = hmap->capacity == 0 ? HASHMAP_INITIAL_CAPACITY    \
+                                                 : hmap->capacity * 2;         \
+      if (!hashmap_##type##_resize(hmap, capacity)) return NULL;               \
+    }                                                                          \
+                                                                               \
+    e = hashmap_##type##_place(hmap, *val);                                    \
+    return e != NULL ? e : hashmap_##type##_lookup(hmap, val);                 \
+  }                                                                            \
+                                                                               \
+  /* Deletes an element equal to `val`.                                        \
+   * returnvalue: true if an element was deleted */                            \
+  static inline bool hashmap_##type##_delete(hashmap_##type* hmap,             \
+                                             const type* val) {                \
+    isize i = hashmap_##type##_find(hmap, val);                                \
+    usize mask, next;                                                          \
+                                                                               \
+    if (i < 0) return false;                                                   \
+                                                                               \
+    /* Shift the following elements one slot closer to their own slot */       \
+    mask = hmap->capacity - 1;                                                 \
+    next = (i + 1) & mask;                                                     \
+    while (hmap->dist[next] > 1) {                                             \
+      const usize d = hashmap_##type##_dist(hmap, next);                       \
+      hmap->elems[i] = hmap->elems[next];                                      \
+      hashmap_##type##_set_dist(hmap, i, d - 1);                               \
+      i = next;                                                                \
+      next = (next + 1) & mask;                                                \
+    }                                                                          \
+    hmap->dist[i] = 0;                                                         \
+    hmap->size--;                                                              \
+    return true;                                                               \
+  }                                                                            \
+                                                                               \
+  /* Returns the next element, in no particular order, or NULL at the end.     \
+   * `*it` is the iterator state and has to start at 0:                        \
+   *                                                                           \
+   *   usize it = 0;                                                           \
+   *   while ((e = hashmap_<type>_iter(hmap, &it)) != NULL) ...                \
+   */                                                                          \
+  static inline type* hashmap_##type##_iter(const hashmap_##type* hmap,        \
+                                            usize* it) {                       \
+    while (*it < hmap->capacity) {                                             \
+      const usize i = (*it)++;                                                 \
+      if (hmap->dist[i] != 0) return &hmap->elems[i];                          \
     }                                                                          \
     return NULL;                                                               \
   }                                                                            \
                                                                                \
-  void hashmap_##type##_insert(memory* m, hashmap_##type* hmap,                \
-                               const type* val) {                              \
-    const i32 idx = lolhash(64, type_to_int(val));                             \
-    List_##type* head = &(hmap->elems[idx]);                                   \
+  /* Starts counting lookups.                                                  \
+   * returnvalue: false if out of memory, lookups are then not counted */      \
+  static inline bool hashmap_##type##_stats_enable(hashmap_##type* hmap) {     \
+    hashmap_counters* counters;                                                \
                                                                                \
-    /* This is highly dependant on whether the memory is zero-initialized */   \
-    if (!type_to_int(&(head->value))) {                                        \
-      memcpy(&(head->value), val, sizeof(type));                               \
-      return;                                                                  \
+    if (hmap->counters != NULL) return true;                                   \
+    counters = allocator_alloc(&hmap->alloc, sizeof(hashmap_counters));        \
+    if (counters == NULL) {                                                    \
+      perror("could not enable hashmap stats");                                \
+      return false;                                                            \
     }                                                                          \
+    memset(counters, 0, sizeof(hashmap_counters));                             \
+    hmap->counters = counters;                                                 \
+    return true;                                                               \
+  }                                                                            \
                                                                                \
-    while (head->next != NULL && cmp(&head->value, val)) {                     \
-      head = head->next;                                                       \
+  static inline void hashmap_##type##_stats_reset(hashmap_##type* hmap) {      \
+    hmap->resizes = 0;                                                         \
+    if (hmap->counters != NULL) {                                              \
+      memset(hmap->counters, 0, sizeof(hashmap_counters));                     \
     }                                                                          \
+  }                                                                            \
                                                                                \
-    if (!cmp(&head->value, val))                                               \
-      memcpy(&(head->value), val, sizeof(type));                               \
-    else {                                                                     \
-      head->next = memory_allocate(m, sizeof(List_##type));                    \
-      memcpy(&(head->next->value), val, sizeof(type));                         \
+  /* Fills `stats`, walking every slot to measure the probe lengths */         \
+  static inline void hashmap_##type##_stats(const hashmap_##type* hmap,        \
+                                            hashmap_stats* stats) {            \
+    usize i, total = 0;                                                        \
+                                                                               \
+    memset(stats, 0, sizeof(hashmap_stats));                                   \
+    stats->size = hmap->size;                                                  \
+    stats->capacity = hmap->capacity;                                          \
+    stats->resizes = hmap->resizes;                                            \
+    if (hmap->capacity > 0) {                                                  \
+      stats->load_factor = (f32)hmap->size / (f32)hmap->capacity;              \
+    }                                                                          \
+                                                                               \
+    for (i = 0; i < hmap->capacity; i++) {                                     \
+      usize d;                                                                 \
+      if (hmap->dist[i] == 0) continue;                                        \
+      d = hashmap_##type##_dist(hmap, i);                                      \
+      total += d;                                                              \
+      if (d > stats->max_probe) stats->max_probe = d;                          \
+      stats->hist[d - 1 < HASHMAP_STATS_HIST ? d - 1                           \
+                                             : HASHMAP_STATS_HIST - 1]++;      \
     }                                                                          \
+    if (hmap->size > 0) stats->avg_probe = (f32)total / (f32)hmap->size;       \
+                                                                               \
+    if (hmap->counters != NULL) {                                              \
+      stats->lookups = hmap->counters->lookups;                                \
+      stats->probes = hmap->counters->probes;                                  \
+      stats->max_lookup_probes = hmap->counters->max_probes;                   \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static inline void hashmap_##type##_stats_log(const hashmap_##type* hmap,    \
+                                                const char* name) {            \
+    hashmap_stats stats;                                                       \
+    hashmap_##type##_stats(hmap, &stats);                                      \
+    hashmap_stats_log(&stats, name);                                           \
   }
 
 #endif
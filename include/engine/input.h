@@ -1,6 +1,7 @@
 #ifndef INPUT_H
 #define INPUT_H
 
+#include <engine/intern.h>
 #include <engine/types.h>
 
 typedef void input_callback_t(void*);
@@ -19,15 +20,15 @@ typedef union action_t {
   struct {
     InputType type;
     input_callback_t* callback;
-    char* callback_str;
+    intern_id callback_id; /* name of `callback` */
   } action;
 
   struct {
     InputType type;
     input_callback_t* activate;
     input_callback_t* deactivate;
-    char* activate_str;
-    char* deactivate_str;
+    intern_id activate_id;
+    intern_id deactivate_id;
   } state;
 } action_t;
 
@@ -71,7 +72,7 @@ void i_bind_alt(binding_t* b, scancode_t s);
                              {                                                 \
                                  .type = InputType_action,                     \
                                  .callback = (input_callback_t*)&f_action,     \
-                                 .callback_str = strdup(#f_action),            \
+                                 .callback_id = intern(#f_action),             \
                              }},                                               \
     .scancode = key, .scancode_alt = altkey, .since_last_activation = 0        \
   }
@@ -84,8 +85,8 @@ void i_bind_alt(binding_t* b, scancode_t s);
                            .type = InputType_state,                            \
                            .activate = (input_callback_t*)&f_activate,         \
                            .deactivate = (input_callback_t*)&f_deactivate,     \
-                           .activate_str = strdup(#f_activate),                \
-                           .deactivate_str = strdup(#f_deactivate),            \
+                           .activate_id = intern(#f_activate),                 \
+                           .deactivate_id = intern(#f_deactivate),             \
                        }},                                                     \
     .scancode = key, .scancode_alt = altkey, .since_last_activation = 0        \
   }
@@ -0,0 +1,36 @@
+#ifndef ENGINE_INTERN_H
+#define ENGINE_INTERN_H
+
+#include "types.h"
+
+/* String interning
+ *
+ * Maps strings, like callback names and asset paths, to small integer ids.
+ * Equal strings get the same id and share a single copy, so comparing two
+ * interned strings is comparing two integers.
+ * Ids are handed out consecutively from 1, and stay valid, along with their
+ * strings, for the lifetime of the program. The table is engine-wide and not
+ * thread safe. */
+
+typedef u32 intern_id;
+
+/* Never returned for an interned string */
+#define INTERN_NONE 0
+
+/* Returns the id of `str`, interning a copy of it first if needed */
+intern_id intern(const char* str);
+
+/* Same as `intern`, for the first `len` bytes of `str` */
+intern_id intern_n(const char* str, usize len);
+
+/* Returns the id of `str`, or `INTERN_NONE` if it was never interned */
+intern_id intern_find(const char* str);
+
+/* Returns the NUL-terminated string of `id`, or NULL for `INTERN_NONE` and
+ * unknown ids */
+const char* intern_str(intern_id id);
+
+/* Returns the number of interned strings, the largest id handed out */
+usize intern_count(void);
+
+#endif
@@ -2,24 +2,181 @@
 #define MEMORY_H
 
 #include "types.h"
+#include <stddef.h>
 // #include <stdlib.h>
 
+/* Memory flags */
+#define MEMORY_MAPPED (1 << 0)  /* data is backed by anonymous pages */
+#define MEMORY_RESERVE (1 << 1) /* only reserve `size`, commit on demand */
+#define MEMORY_HUGEPAGES (1 << 2) /* back with transparent huge pages */
+
+/* Size of a (transparent) huge page, 2 MiB on x86-64 */
+#define MEMORY_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* Alignment of state data and anything that is accessed in hot loops */
+#define MEMORY_CACHE_LINE 64
+
+/* Alignment requirement of `type` */
+#define MEMORY_ALIGNOF(type)                                                   \
+  offsetof(                                                                    \
+      struct {                                                                 \
+        char c;                                                                \
+        type t;                                                                \
+      },                                                                       \
+      t)
+
+/* Number of distinct tags tracked per memory block, further tags are counted
+ * under the last entry */
+#define MEMORY_STATS_TAGS 64
+
+/* Tag for the calling source line, eg. "src/fov.c:42" */
+#define MEMORY_TAG_HERE __FILE__ ":" MEMORY_XSTR(__LINE__)
+#define MEMORY_XSTR(a) MEMORY_STR(a)
+#define MEMORY_STR(a) #a
+
+typedef struct memory_tag_stats {
+  const char* tag; /* NULL for untagged allocations */
+  usize bytes;
+  usize count;
+} memory_tag_stats;
+
+typedef struct memory_stats {
+  usize peak;        /* largest `pos` seen */
+  usize bytes;       /* total bytes handed out */
+  usize allocations; /* total number of allocations */
+  usize tags_len;
+  memory_tag_stats tags[MEMORY_STATS_TAGS];
+} memory_stats;
+
 typedef struct memory {
   void* data;
   usize size;
   usize pos;
   usize free;
+  usize committed; /* bytes that are readable/writable, `size` unless reserved */
+  usize hwm;       /* high-water mark, bytes dirtied since the last clear */
+  u32 flags;
+  memory_stats* stats; /* NULL unless enabled with `memory_stats_enable` */
 } memory;
 
+/* A savepoint in a memory block, see `memory_mark` */
+typedef struct memory_mark_t {
+  usize pos;
+} memory_mark_t;
+
 memory* memory_new(usize max_size);
 
+/* Same as `memory_new`, but with `MEMORY_*` flags.
+ * With `MEMORY_RESERVE` only the address range is reserved up front, and pages
+ * are committed as allocations reach them. Pointers stay valid as the block
+ * grows, so `max_size` can be set generously without costing resident memory.
+ * With `MEMORY_HUGEPAGES` the block is huge page aligned and the kernel is
+ * asked to back it with transparent huge pages, which cuts TLB misses on large
+ * randomly accessed data. If they are unavailable regular pages are used, and
+ * `MEMORY_HUGEPAGES` is not set in the blocks flags.
+ */
+memory* memory_new_ex(usize max_size, u32 flags);
+
 /* Returns a pointer to the allocated data */
 void* memory_allocate(memory* mem, usize size);
 
+/* Same as `memory_allocate`, but accounts the allocation under `tag` when
+ * stats are enabled. `tag` must outlive the memory block, typically it is a
+ * string literal or `MEMORY_TAG_HERE`. */
+void* memory_allocate_tagged(memory* mem, usize size, const char* tag);
+
+#define memory_allocate_here(mem, size)                                        \
+  memory_allocate_tagged(mem, size, MEMORY_TAG_HERE)
+
+/* Same as `memory_allocate`, but the returned pointer is a multiple of `align`,
+ * which must be a power of two. The padding is taken from the memory block. */
+void* memory_allocate_aligned(memory* mem, usize size, usize align);
+
+/* Typed allocations, aligned to the natural alignment of `type` */
+#define memory_allocate_struct(mem, type)                                      \
+  ((type*)memory_allocate_aligned(mem, sizeof(type), MEMORY_ALIGNOF(type)))
+
+#define memory_allocate_array(mem, type, n)                                    \
+  ((type*)memory_allocate_aligned(mem, sizeof(type) * (n),                    \
+                                  MEMORY_ALIGNOF(type)))
+
+/* `data` should be `MEMORY_CACHE_LINE` aligned if it is to hold state data */
 memory memory_init(void* data, usize size);
 
 void memory_free(memory* mem, usize size);
 
+/* Rewinds and zeroes the memory block. Only the bytes below the high-water
+ * mark are cleared, larger mapped regions are handed back to the kernel and
+ * come back as zero pages on next use. */
 void memory_clear(memory* mem);
 
+/* Rewinds the memory block to its beginning without zeroing it. Use this for
+ * scratch memory that is thrown away wholesale, where `memory_clear` would be
+ * wasted work. */
+void memory_reset(memory* mem);
+
+/* Pools */
+
+/* Size classes are powers of two from MEMORY_POOL_MIN up to
+ * MEMORY_POOL_MIN << (MEMORY_POOL_CLASSES - 1), ie. 16 to 2048 bytes */
+#define MEMORY_POOL_MIN 16
+#define MEMORY_POOL_CLASSES 8
+
+/* A pool hands out fixed size objects from a memory block and keeps a free
+ * list per size class, so objects can be recycled without the memory block
+ * growing. Allocating and freeing are both O(1).
+ * Clearing or rewinding the memory block below the pools allocations
+ * invalidates the pool, create a new one afterwards. */
+typedef struct memory_pool {
+  memory* mem;
+  void* free_list[MEMORY_POOL_CLASSES];
+} memory_pool;
+
+memory_pool memory_pool_new(memory* mem);
+
+/* Returns an object of at least `size` bytes. Its contents are undefined.
+ * Requests larger than the largest size class are served directly from the
+ * memory block, and are never recycled. */
+void* memory_pool_allocate(memory_pool* pool, usize size);
+
+/* Returns `ptr` to the pool. `size` must be the size it was allocated with. */
+void memory_pool_free(memory_pool* pool, void* ptr, usize size);
+
+/* Savepoints */
+
+/* Returns a savepoint that `memory_rewind` can later return to, releasing
+ * everything allocated after it in one go. Savepoints nest, eg.
+ *
+ *   memory_mark_t level = memory_mark(mem);
+ *   ... generate the level ...
+ *     memory_mark_t scratch = memory_mark(mem);
+ *     ... temporary buffers ...
+ *     memory_rewind(mem, scratch);
+ *   memory_rewind(mem, level);
+ */
+memory_mark_t memory_mark(const memory* mem);
+
+/* Releases everything allocated since `mark`. Rewinding to a savepoint that
+ * has already been rewound past is an error. The memory is not zeroed. */
+void memory_rewind(memory* mem, memory_mark_t mark);
+
+/* Stats */
+
+/* Starts accounting allocations in `mem`. Until then the only cost is a NULL
+ * check per allocation. */
+void memory_stats_enable(memory* mem);
+
+/* returnvalue: the stats of `mem`, NULL if they are not enabled */
+const memory_stats* memory_stats_get(const memory* mem);
+
+void memory_stats_reset(memory* mem);
+
+/* Logs peak usage and per tag bytes and counts of `mem` */
+void memory_stats_log(const memory* mem, const char* name);
+
+/* Returns the engines per-frame scratch memory. It is rewound at the start of
+ * every iteration of the main loop, so anything allocated from it must not be
+ * kept across frames. */
+memory* memory_frame(void);
+
 #endif
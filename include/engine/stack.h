@@ -25,19 +25,26 @@
 #ifndef STACK_H
 #define STACK_H
 
+#include "allocator.h"
 #include "types.h"
 
 typedef struct {
-  isize head;             /* current number of elements */
-  const usize elem_size;  /* size in bytes of each element */
-  usize size;             /* current memory size used by the stack */
-  const usize chunk_size; /* size of which the stack increases when running out
-                             of mem */
-  void* data;             /* memory buffer */
+  isize head;            /* current number of elements */
+  const usize elem_size; /* size in bytes of each element */
+  usize size;            /* current memory size used by the stack, doubles when
+                            running out of mem */
+  void* data;            /* memory buffer */
+  allocator alloc;       /* allocator of `data` */
 } Stack;
 
 Stack stack_new_ex(const usize element_size, const usize size);
 
+/* Same as `stack_new_ex`, but `data` is allocated with `alloc`. With
+ * `allocator_memory` the stack grows in place as long as nothing else has been
+ * allocated from the memory block after it. */
+Stack stack_new_with_allocator(const usize element_size, const usize size,
+                               const allocator* alloc);
+
 Stack stack_new(const usize element_size);
 
 void stack_free(Stack* s);
@@ -45,6 +52,19 @@ void* stack_pop(Stack* s);
 void stack_push(Stack* s, void* elem);
 void* stack_peek(Stack* s);
 isize stack_size(const Stack* s);
+
+/* Swaps the contents of two stacks of the same element size in O(1) */
 void stack_swap(Stack* s, Stack* t);
 
+/* Makes room for at least `n` more elements without further reallocations */
+void stack_reserve(Stack* s, const usize n);
+
+/* Pushes `n` elements from the array `elems` in one copy */
+void stack_push_n(Stack* s, const void* elems, const usize n);
+
+/* Pops `n` elements at once. Returns a pointer to the first (deepest) of them,
+ * which stays valid until the next push, or NULL if there are fewer than `n`
+ * elements on the stack */
+void* stack_pop_n(Stack* s, const usize n);
+
 #endif
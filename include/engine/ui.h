@@ -1,6 +1,7 @@
 #ifndef ENGINE_UI_H
 #define ENGINE_UI_H
 
+#include "allocator.h"
 #include "list.h"
 #include "types.h"
 #include "vector.h"
@@ -238,6 +239,11 @@ UITree* ui_container_new_ex(Engine_color fg, Engine_color bg,
                             Engine_color border, bool direction,
                             struct List_ui_constraint* constraints);
 
+/* Sets the allocator used by the constructors. It only applies to elements
+ * constructed afterwards, and must not change while elements constructed with
+ * the previous allocator are still alive. Defaults to `allocator_malloc`. */
+void ui_set_allocator(const allocator* a);
+
 /* Destructors */
 void clear_ui(void);
 void uitree_free(UITree* t);
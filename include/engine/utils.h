@@ -21,7 +21,7 @@
 f32 lerp(f32 dt, f32 a, f32 b);
 i32 int_lerp(f32 dt, i32 a, i32 b);
 
-/* Hashes */
+/* Hashes, see engine/hash.h for 64-bit and seeded variants */
 u32 hash(char* str);
 
 /* Masks surrounding tiles of a kernel size of 3x3 */
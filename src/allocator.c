@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <engine/allocator.h>
+#include <engine/logging.h>
+
+/* malloc */
+static void* allocator_malloc_alloc(void* ctx, size_t size) {
+  void* ptr = malloc(size);
+  (void)ctx;
+  if (ptr == NULL) {
+    ERROR("Failed to allocate %lu bytes", size);
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static void* allocator_malloc_realloc(void* ctx, void* ptr, size_t old_size,
+                                      size_t new_size) {
+  void* new_ptr = realloc(ptr, new_size);
+  (void)ctx;
+  (void)old_size;
+  if (new_ptr == NULL) {
+    ERROR("Failed to reallocate %lu bytes", new_size);
+    exit(EXIT_FAILURE);
+  }
+  return new_ptr;
+}
+
+static void allocator_malloc_dealloc(void* ctx, void* ptr, size_t size) {
+  (void)ctx;
+  (void)size;
+  free(ptr);
+}
+
+allocator allocator_malloc(void) {
+  allocator a = {
+      .alloc = allocator_malloc_alloc,
+      .realloc = allocator_malloc_realloc,
+      .dealloc = allocator_malloc_dealloc,
+      .ctx = NULL,
+  };
+  return a;
+}
+
+/* memory */
+static void* allocator_memory_alloc(void* ctx, size_t size) {
+  return memory_allocate_aligned(ctx, size, ALLOCATOR_ALIGN);
+}
+
+static void* allocator_memory_realloc(void* ctx, void* ptr, size_t old_size,
+                                      size_t new_size) {
+  memory* mem = ctx;
+  void* new_ptr;
+
+  /* The most recent allocation can grow or shrink in place */
+  if ((u8*)ptr + old_size == (u8*)mem->data + mem->pos) {
+    if (new_size <= old_size) {
+      memory_free(mem, old_size - new_size);
+      return ptr;
+    }
+    memory_allocate(mem, new_size - old_size);
+    return ptr;
+  }
+
+  new_ptr = allocator_memory_alloc(ctx, new_size);
+  if (ptr != NULL) {
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+  }
+  return new_ptr;
+}
+
+static void allocator_memory_dealloc(void* ctx, void* ptr, size_t size) {
+  (void)ctx;
+  (void)ptr;
+  (void)size;
+}
+
+allocator allocator_memory(memory* mem) {
+  allocator a = {
+      .alloc = allocator_memory_alloc,
+      .realloc = allocator_memory_realloc,
+      .dealloc = allocator_memory_dealloc,
+      .ctx = mem,
+  };
+  return a;
+}
+
+/* pool */
+static void* allocator_pool_alloc(void* ctx, size_t size) {
+  return memory_pool_allocate(ctx, size);
+}
+
+static void* allocator_pool_realloc(void* ctx, void* ptr, size_t old_size,
+                                    size_t new_size) {
+  void* new_ptr = memory_pool_allocate(ctx, new_size);
+  if (ptr != NULL) {
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    memory_pool_free(ctx, ptr, old_size);
+  }
+  return new_ptr;
+}
+
+static void allocator_pool_dealloc(void* ctx, void* ptr, size_t size) {
+  memory_pool_free(ctx, ptr, size);
+}
+
+allocator allocator_pool(memory_pool* pool) {
+  allocator a = {
+      .alloc = allocator_pool_alloc,
+      .realloc = allocator_pool_realloc,
+      .dealloc = allocator_pool_dealloc,
+      .ctx = pool,
+  };
+  return a;
+}
@@ -5,47 +5,76 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <sys/types.h>
+#if defined(__unix__)
+#include <sched.h>
+#endif
+
+/* Spins on the writer latch before giving up the CPU */
+#define BTREE_LATCH_SPINS 64
 
 /* Definitions */
 typedef unsigned char byte;
 
-struct node {
-  ssize_t n; /* number of items/keys/elements */
-  ssize_t c; /* number of children */
-  byte* items;
-  struct node** children;
-};
-
 struct btree {
   /* Memory stuffs */
-  void* (*alloc)(size_t);
-  void (*dealloc)(void*);
+  allocator alloc;
 
   /* Size stuffs */
   size_t elem_size;
   ssize_t degree;
 
-  struct node* root;
+  int flags; /* `BTREE_*` flags */
+
+  /* Node layout, see `struct btree_node` */
+  size_t children_offset;
+  size_t leaf_size;
+  size_t internal_size;
+
+  struct btree_node* root;
+
+  /* Only allocated in concurrent mode, see `BTREE_CONCURRENT` */
+  struct btree_sync* sync;
 
   /* comparison */
   int (*cmp)(const void* a, const void* b);
+  btree_bound_fn bound; /* NULL to binary search with `cmp` */
+};
+
+/* Writer state of a concurrent tree.
+ * A writer holds `latch` for a whole operation, and locks every node before
+ * modifying it by making its version odd. The locked nodes are released at the
+ * end of the operation, so readers see either none or all of its changes.
+ * Nodes removed from the tree are kept until `btree_reclaim`, since readers
+ * may still be looking at them. */
+struct btree_sync {
+  bool latch;
+
+  struct btree_node** locked;
+  size_t locked_len;
+  size_t locked_size;
+
+  struct btree_node** retired;
+  size_t retired_len;
+  size_t retired_size;
 };
 
 struct btree_iter_t {
-  size_t head;
-  struct stack {
-    int pos;
-    struct node* node;
-  } stack[512];
-  /* This heavily relies on the assumption that a tree never grows deeper than
-   * 512 nodes */
+  size_t head;  /* number of entries on the stack */
+  size_t depth; /* capacity of the stack, at least the height of the tree */
+  struct btree_iter_t_frame {
+    ssize_t pos;
+    struct btree_node* node;
+  } stack[];
 };
 
+#define btree_iter_size(depth)                                                 \
+  (sizeof(struct btree_iter_t) +                                               \
+   (depth) * sizeof(struct btree_iter_t_frame))
+
 /**********************/
 /* Node functionality */
 /**********************/
-#define node_leaf(node) (node->children == NULL)
+#define node_leaf(node) ((node)->leaf)
 
 #define node_maxdegree(t) (2 * t - 1)
 
@@ -53,69 +82,213 @@ struct btree_iter_t {
 
 #define node_full(degree, t) (t->n >= 2 * degree - 1)
 
+#define node_items_size(degree, elem_size) (2 * (degree) * (elem_size))
+#define node_children_size(degree)                                             \
+  ((2 * (degree) + 1) * sizeof(struct btree_node*))
+
+#define node_items(x) btree_node_items(x)
+#define node_children(tree, x) btree_node_children(x, (tree)->children_offset)
+
+#define node_alloc_size(tree, x)                                               \
+  (node_leaf(x) ? (tree)->leaf_size : (tree)->internal_size)
+
+/* B+tree mode, see `BTREE_PLUS` */
+#define node_plus(tree) ((tree)->flags & BTREE_PLUS)
+#define node_prev(tree, x) (node_children(tree, x)[BTREE_LEAF_PREV])
+#define node_next(tree, x) (node_children(tree, x)[BTREE_LEAF_NEXT])
+
+/* Number of elements a separator item counts for. In a B+tree the items of
+ * internal nodes are copies, and all elements live in the leaves. */
+#define node_sep_count(tree) (node_plus(tree) ? 0 : 1)
+/* Number of elements stored in `x` itself */
+#define node_own_count(tree, x)                                                \
+  (node_leaf(x) ? (x)->n : (x)->n * node_sep_count(tree))
+
+/* `node_count_children` sums the element counts of children `from`..`to` */
+static ssize_t node_count_children(const struct btree* tree,
+                                   const struct btree_node* x, ssize_t from,
+                                   ssize_t to) {
+  ssize_t sum = 0;
+  ssize_t j;
+
+  if (node_leaf(x)) return 0;
+  for (j = from; j < to; j++) {
+    sum += node_children(tree, x)[j]->count;
+  }
+  return sum;
+}
+
 /* Node memory */
 
-/* `node_new` allocates a new leaf node, children should be added and allocated
- * when the node is no longer a leaf node */
-struct node* node_new(const ssize_t degree, const size_t elem_size) {
-  const size_t max_items = 2 * degree;
-  struct node* retval = calloc(1, sizeof(struct node));
+/* `node_new` allocates a new node. Internal nodes get room for their children
+ * up front, so a node never has to change size. */
+struct btree_node* node_new(const struct btree* tree, bool leaf) {
+  const size_t size = leaf ? tree->leaf_size : tree->internal_size;
+  struct btree_node* retval = allocator_alloc(&tree->alloc, size);
 
-  retval->n = 0;
-  retval->c = 0;
-  retval->items = calloc(max_items, elem_size);
-  retval->children = NULL;
+  if (retval == NULL) {
+    perror("could not allocate btree node");
+    return NULL;
+  }
+
+  memset(retval, 0, size);
+  retval->leaf = leaf;
 
   return retval;
 }
 
-/* `node_transition` turns a leaf node into a non-leaf. Children are not
- * allocated.
- * returnvalue: `false` if we we're unable to allocate space for the new
- * children. */
-bool node_transition(struct node* node, const ssize_t degree) {
-  const int max_children = 2 * degree + 1;
-  int c;
+/* `node_dealloc` frees a single node, but not its children */
+void node_dealloc(const struct btree* tree, struct btree_node* node) {
+  allocator_dealloc(&tree->alloc, node, node_alloc_size(tree, node));
+}
 
-  if (!node_leaf(node)) {
-    perror("node_transition was called on an already non-leaf node?");
-    return false;
+/* Concurrency */
+
+/* `node_list_push` appends `x` to a growable list of nodes */
+static void node_list_push(const struct btree* tree, struct btree_node*** list,
+                           size_t* len, size_t* size, struct btree_node* x) {
+  if (*len == *size) {
+    const size_t new_size = *size == 0 ? 16 : *size * 2;
+    *list = allocator_realloc(&tree->alloc, *list,
+                              *size * sizeof(struct btree_node*),
+                              new_size * sizeof(struct btree_node*));
+    *size = new_size;
   }
+  (*list)[(*len)++] = x;
+}
+
+/* `node_write` locks `x` before it is modified, in concurrent mode */
+static void node_write(const struct btree* tree, struct btree_node* x) {
+  struct btree_sync* sync = tree->sync;
+  unsigned int v;
+
+  if (sync == NULL || x == NULL) return;
 
-  /* Allocate pointers for children */
-  node->children = calloc(max_children, sizeof(struct node*));
+  v = __atomic_load_n(&x->version, __ATOMIC_RELAXED);
+  if (v & 1) return; /* already locked by this operation */
 
-  if (node->children == NULL) {
-    perror("could not allocate space for children pointers");
-    return false;
+  __atomic_store_n(&x->version, v + 1, __ATOMIC_RELAXED);
+  /* Readers must not see any of the following writes without the lock */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  node_list_push(tree, &sync->locked, &sync->locked_len, &sync->locked_size,
+                 x);
+}
+
+/* `node_retire` frees a node that is no longer part of the tree. In
+ * concurrent mode, it is kept around until `btree_reclaim`. */
+static void node_retire(const struct btree* tree, struct btree_node* x) {
+  struct btree_sync* sync = tree->sync;
+
+  if (sync == NULL) {
+    node_dealloc(tree, x);
+    return;
   }
+  node_list_push(tree, &sync->retired, &sync->retired_len,
+                 &sync->retired_size, x);
+}
+
+/* `btree_pause` is called in every iteration of a spin loop */
+static inline void btree_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/* `btree_write_begin` takes the writer latch, in concurrent mode. Writers
+ * hold it for a whole operation, so a waiting writer yields its time slice
+ * after a few spins. */
+static void btree_write_begin(struct btree* tree) {
+  unsigned int spins = 0;
+
+  if (tree->sync == NULL) return;
+  while (__atomic_test_and_set(&tree->sync->latch, __ATOMIC_ACQUIRE)) {
+    if (++spins < BTREE_LATCH_SPINS) {
+      btree_pause();
+      continue;
+    }
+#if defined(__unix__)
+    sched_yield();
+#endif
+  }
+}
+
+/* `btree_write_end` publishes the changes of a write by unlocking every node
+ * it modified, and releases the writer latch */
+static void btree_write_end(struct btree* tree) {
+  struct btree_sync* sync = tree->sync;
+  size_t i;
+
+  if (sync == NULL) return;
 
-  /* Allocate children */
-  for (c = 0; c < max_children; c++) {
-    node->children[c] = NULL;
+  for (i = 0; i < sync->locked_len; i++) {
+    struct btree_node* x = sync->locked[i];
+    const unsigned int v = __atomic_load_n(&x->version, __ATOMIC_RELAXED);
+    __atomic_store_n(&x->version, v + 1, __ATOMIC_RELEASE);
   }
+  sync->locked_len = 0;
 
-  return true;
+  __atomic_clear(&sync->latch, __ATOMIC_RELEASE);
 }
 
-void node_free(struct node** node, size_t elem_size, void (*dealloc)(void*)) {
+/* `btree_set_root` publishes a new root to concurrent readers */
+static void btree_set_root(struct btree* tree, struct btree_node* root) {
+  __atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+}
+
+void node_free(const struct btree* tree, struct btree_node** node) {
   if (*node == NULL) return;
 
   if (!node_leaf((*node))) {
     ssize_t i;
     for (i = 0; i < (*node)->c; i++) {
-      node_free(&((*node)->children[i]), elem_size, dealloc);
+      node_free(tree, &(node_children(tree, (*node))[i]));
     }
-    dealloc((*node)->children);
   }
 
-  dealloc((*node)->items);
-  (*node)->items = NULL;
-
-  dealloc(*node);
+  node_dealloc(tree, *node);
   *node = NULL;
 }
 
+/* `node_split_leaf` is `node_tree_split_child` for the leaves of a B+tree.
+ * The upper `t` items of the full leaf `y` move to the new leaf `z`, and a
+ * copy of the first of them becomes the separator in the parent. `z` is
+ * linked into the leaf chain after `y`. */
+static void node_split_leaf(const struct btree* tree, struct btree_node* parent,
+                            ssize_t i, struct btree_node* z) {
+  const ssize_t t = tree->degree;
+  const size_t elem_size = tree->elem_size;
+  struct btree_node* y = node_children(tree, parent)[i];
+  byte* sep = node_items(parent) + elem_size * i;
+
+  node_write(tree, node_next(tree, y));
+
+  memcpy(node_items(z), node_items(y) + elem_size * (t - 1), elem_size * t);
+  z->n = t;
+  z->count = t;
+  y->n = t - 1;
+  y->count = t - 1;
+
+  /* Link `z` in after `y` */
+  node_next(tree, z) = node_next(tree, y);
+  node_prev(tree, z) = y;
+  if (node_next(tree, y) != NULL) node_prev(tree, node_next(tree, y)) = z;
+  node_next(tree, y) = z;
+
+  /* Make room for `z` and its separator in the parent */
+  memmove(&node_children(tree, parent)[i + 2],
+          &node_children(tree, parent)[i + 1],
+          sizeof(struct btree_node*) * (parent->c - i - 1));
+  node_children(tree, parent)[i + 1] = z;
+  parent->c++;
+
+  memmove(sep + elem_size, sep, elem_size * (parent->n - i));
+  memcpy(sep, node_items(z), elem_size);
+  parent->n++;
+}
+
 /* `node_tree_split_child` splits a _full_ node (c = 2t-1 items) into two nodes
  * with t-1 items each.
  * The median key/item/element moves up to the original nodes parent, to signify
@@ -126,15 +299,21 @@ void node_free(struct node** node, size_t elem_size, void (*dealloc)(void*)) {
  * full nodes we encounter on the way down, including the leafs themselves.
  * By doing this, we are assured that whenever we split a node, its parent has
  * room for the median key. */
-void node_tree_split_child(const ssize_t t, const size_t elem_size,
-                           struct node* nonfull, ssize_t i) {
-  struct node* z = node_new(t, elem_size);
-  struct node* y = nonfull->children[i];
+void node_tree_split_child(const struct btree* tree, struct btree_node* nonfull,
+                           ssize_t i) {
+  const ssize_t t = tree->degree;
+  const size_t elem_size = tree->elem_size;
+  struct btree_node* y = node_children(tree, nonfull)[i];
+  /* `z` should be a branching node if `y` is */
+  struct btree_node* z = node_new(tree, node_leaf(y));
   ssize_t j;
 
-  /* `z` should be a branching node if `y` is */
-  if (!node_leaf(y)) {
-    node_transition(z, t);
+  node_write(tree, nonfull);
+  node_write(tree, y);
+
+  if (node_plus(tree) && node_leaf(y)) {
+    node_split_leaf(tree, nonfull, i, z);
+    return;
   }
 
   z->n = t - 1;
@@ -144,14 +323,14 @@ void node_tree_split_child(const ssize_t t, const size_t elem_size,
   for (j = 0; j < t - 1; j++) {
     const size_t offset_dst = elem_size * j;
     const size_t offset_src = elem_size * (t + j);
-    memcpy((z->items) + offset_dst, (y->items) + offset_src, elem_size);
+    memcpy(node_items(z) + offset_dst, node_items(y) + offset_src, elem_size);
   }
   /* Set unused item-memory to zero? */
 
   /* Move children t..2t, if applicable*/
   if (!node_leaf(y)) {
     for (j = 0; j < t + 1; j++) {
-      z->children[j] = y->children[j + t];
+      node_children(tree, z)[j] = node_children(tree, y)[j + t];
     }
     y->c = t;
     z->c = t;
@@ -159,26 +338,30 @@ void node_tree_split_child(const ssize_t t, const size_t elem_size,
 
   y->n = t - 1;
 
+  /* The median moves up, the rest of `z`s elements move out of `y` */
+  z->count = node_count_children(tree, z, 0, z->c) + node_own_count(tree, z);
+  y->count -= z->count + node_sep_count(tree);
+
   /* Move children +1 */
   for (j = nonfull->n; j > i; j--) {
-    nonfull->children[j + 1] = nonfull->children[j];
+    node_children(tree, nonfull)[j + 1] = node_children(tree, nonfull)[j];
   }
 
   /* new child */
-  nonfull->children[i + 1] = z;
+  node_children(tree, nonfull)[i + 1] = z;
   nonfull->c++;
 
   /* moving keys i..n + 1*/
   /* TODO This can be done with one memcpy */
   for (j = nonfull->n; j >= i; j--) {
     const size_t offset = j * elem_size;
-    memcpy((nonfull->items) + offset + elem_size, (nonfull->items) + offset,
-           elem_size);
+    memcpy(node_items(nonfull) + offset + elem_size,
+           node_items(nonfull) + offset, elem_size);
   }
 
   /* Lastly, copy the median element to nonfull-parent*/
-  memcpy((nonfull->items) + i * elem_size, (y->items) + (t - 1) * elem_size,
-         elem_size);
+  memcpy(node_items(nonfull) + i * elem_size,
+         node_items(y) + (t - 1) * elem_size, elem_size);
 
   nonfull->n++;
 }
@@ -192,64 +375,83 @@ void node_tree_split_child(const ssize_t t, const size_t elem_size,
  *
  * WARNING: THIS FUNCTION ASSUMES THAT `i` IS A VALID INDEX
  */
-void node_child_merge(struct node* x, ssize_t i, const size_t elem_size,
-                      void (*dealloc)(void*)) {
-  struct node* y = x->children[i];
-  struct node* z = x->children[i + 1];
+void node_child_merge(const struct btree* tree, struct btree_node* x,
+                      ssize_t i) {
+  const size_t elem_size = tree->elem_size;
+  struct btree_node* y = node_children(tree, x)[i];
+  struct btree_node* z = node_children(tree, x)[i + 1];
   int j = 0;
 
+  node_write(tree, x);
+  node_write(tree, y);
+  /* Readers still inside `z` have to retry */
+  node_write(tree, z);
+
   /* append k to y */
-  memcpy(y->items + (elem_size * y->n++), x->items + (elem_size * i),
+  memcpy(node_items(y) + (elem_size * y->n++), node_items(x) + (elem_size * i),
          elem_size);
 
   /* append keys in z to y */
-  memcpy(y->items + (elem_size * y->n), z->items, elem_size * z->n);
+  memcpy(node_items(y) + (elem_size * y->n), node_items(z), elem_size * z->n);
   y->n += z->n;
 
   /* Move children from z to y */
   for (j = 0; j < z->c; j++) {
-    y->children[y->c + j] = z->children[j];
+    node_children(tree, y)[y->c + j] = node_children(tree, z)[j];
   }
   y->c += z->c;
+  y->count += z->count + node_sep_count(tree);
 
   /* Remove z from x */
   for (j = i + 1; j < x->c; j++) {
-    x->children[j] = x->children[j + 1];
+    node_children(tree, x)[j] = node_children(tree, x)[j + 1];
   }
   x->c--;
 
   /* remove k from x */
-  /* TODO check if we need to use (x->n - 1 - i) instead */
-  memmove(x->items + (elem_size * i), x->items + (elem_size * (i + 1)),
-          elem_size * (x->n - i));
+  memmove(node_items(x) + (elem_size * i),
+          node_items(x) + (elem_size * (i + 1)), elem_size * (x->n - 1 - i));
   x->n--;
 
-  dealloc(z); /* DO NOT USE THE RECURSIVE ONE AS CHILDREN WILL BE LOST!!! */
+  /* DO NOT USE THE RECURSIVE ONE AS CHILDREN WILL BE LOST!!! */
+  node_retire(tree, z);
 }
 
 /* ASSUME i < x->c */
-void node_shift_left(struct node* x, ssize_t i, const size_t elem_size) {
-  struct node* y = x->children[i];
-  struct node* z = x->children[i + 1];
-  byte* x_k = x->items + (elem_size * i);
+void node_shift_left(const struct btree* tree, struct btree_node* x,
+                     ssize_t i) {
+  const size_t elem_size = tree->elem_size;
+  struct btree_node* y = node_children(tree, x)[i];
+  struct btree_node* z = node_children(tree, x)[i + 1];
+  byte* x_k = node_items(x) + (elem_size * i);
+
+  node_write(tree, x);
+  node_write(tree, y);
+  node_write(tree, z);
 
   /* Append x.k[i] to y */
-  memcpy(y->items + (elem_size * y->n++), x_k, elem_size);
+  memcpy(node_items(y) + (elem_size * y->n++), x_k, elem_size);
 
   /* Move first element of z to x.k[i] */
-  memcpy(x_k, z->items, elem_size);
+  memcpy(x_k, node_items(z), elem_size);
 
   /* Shift z's items left */
-  memmove(z->items, z->items + elem_size, elem_size * (z->n - 1));
+  memmove(node_items(z), node_items(z) + elem_size, elem_size * (z->n - 1));
+
+  y->count += node_sep_count(tree);
+  z->count -= node_sep_count(tree);
 
   if (!node_leaf(z)) {
+    const ssize_t moved = node_children(tree, z)[0]->count;
     ssize_t j;
     /* append first child of z to y */
-    y->children[y->c++] = z->children[0];
+    node_children(tree, y)[y->c++] = node_children(tree, z)[0];
+    y->count += moved;
+    z->count -= moved;
 
     /* Shift z's children left */
     for (j = 0; j < z->c; j++) {
-      z->children[j] = z->children[j + 1];
+      node_children(tree, z)[j] = node_children(tree, z)[j + 1];
     }
     z->c--;
   }
@@ -257,261 +459,369 @@ void node_shift_left(struct node* x, ssize_t i, const size_t elem_size) {
   z->n--;
 }
 
-void node_shift_right(struct node* x, ssize_t i, const size_t elem_size) {
-  struct node* y = x->children[i];
-  struct node* z = x->children[i + 1];
-  byte* x_k = x->items + (elem_size * i);
+void node_shift_right(const struct btree* tree, struct btree_node* x,
+                      ssize_t i) {
+  const size_t elem_size = tree->elem_size;
+  struct btree_node* y = node_children(tree, x)[i];
+  struct btree_node* z = node_children(tree, x)[i + 1];
+  byte* x_k = node_items(x) + (elem_size * i);
+
+  node_write(tree, x);
+  node_write(tree, y);
+  node_write(tree, z);
 
   /* Shift z's items right */
-  memmove(z->items + elem_size, z->items, elem_size * z->n);
+  memmove(node_items(z) + elem_size, node_items(z), elem_size * z->n);
 
   /* Prepend x.k[i] to z */
-  memcpy(z->items, x_k, elem_size);
+  memcpy(node_items(z), x_k, elem_size);
 
   /* Move last element of y to x.k[i] */
-  memcpy(x_k, y->items + (elem_size * --(y->n)), elem_size);
+  memcpy(x_k, node_items(y) + (elem_size * --(y->n)), elem_size);
+
+  y->count -= node_sep_count(tree);
+  z->count += node_sep_count(tree);
 
   if (!node_leaf(z)) {
     size_t j;
     /* Shift z's children right */
     for (j = z->c; j > 0; j--) {
-      z->children[j] = z->children[j - 1];
+      node_children(tree, z)[j] = node_children(tree, z)[j - 1];
     }
     z->c++;
 
     /* prepend last child of y to z */
-    z->children[0] = y->children[--(y->c)];
+    node_children(tree, z)[0] = node_children(tree, y)[--(y->c)];
+    y->count -= node_children(tree, z)[0]->count;
+    z->count += node_children(tree, z)[0]->count;
   }
 
   z->n++;
 }
 
+/* `node_bound` binary searches the items of `x`.
+ * returnvalue: the index of the first item that is not less than `key`, or
+ * with `upper`, the index of the first item that is greater than `key` */
+ssize_t node_bound(const struct btree* tree, const struct btree_node* x,
+                   const void* key, bool upper) {
+  const size_t elem_size = tree->elem_size;
+  ssize_t lo = 0;
+  ssize_t hi = x->n;
+
+  if (tree->bound != NULL) return tree->bound(x, key, upper);
+
+  while (lo < hi) {
+    const ssize_t mid = lo + (hi - lo) / 2;
+    const int res = tree->cmp(key, node_items(x) + mid * elem_size);
+    if (res > 0 || (upper && res == 0)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
 /* return: Returns the new root, if a split happens */
-void node_insert_nonfull(struct node* root, void* elem, const ssize_t degree,
-                         const size_t elem_size,
-                         int (*cmp)(const void* a, const void* b)) {
+void node_insert_nonfull(const struct btree* tree, struct btree_node* root,
+                         void* elem) {
+  const ssize_t degree = tree->degree;
+  const size_t elem_size = tree->elem_size;
+  int (*cmp)(const void* a, const void* b) = tree->cmp;
 
-  /* TODO check correctness */
-  ssize_t i = root->n - 1;
+  /* Equal elements are inserted after the existing ones */
+  ssize_t i = node_bound(tree, root, elem, true);
 
-  if (node_leaf(root)) {
-    size_t offset = elem_size * i;
-    while (i >= 0 && cmp(elem, root->items + offset) < 0) {
-      /* TODO This can be done with one memcpy */
-      memcpy(root->items + offset + elem_size, root->items + offset, elem_size);
+  /* The element ends up somewhere below this node */
+  node_write(tree, root);
+  root->count++;
 
-      i--;
-      offset = elem_size * i;
-    }
-    offset = elem_size * (++i);
-    memcpy(root->items + offset, elem, elem_size);
+  if (node_leaf(root)) {
+    const size_t offset = elem_size * i;
+    memmove(node_items(root) + offset + elem_size, node_items(root) + offset,
+            elem_size * (root->n - i));
+    memcpy(node_items(root) + offset, elem, elem_size);
     root->n++;
 
   } else {
-    size_t offset = elem_size * i;
-    struct node* nextchild = NULL;
-    while (i >= 0 && cmp(elem, root->items + offset) < 0) {
-      i--;
-      offset = elem_size * i;
-    }
-    i++;
-    nextchild = root->children[i];
+    struct btree_node* nextchild = NULL;
+    nextchild = node_children(tree, root)[i];
     if (node_full(degree, nextchild)) {
       /* TODO Check if the root has changed */
-      node_tree_split_child(degree, elem_size, root, i);
-      if (cmp(elem, root->items + elem_size * i) > 0) {
-        nextchild = root->children[++i];
+      node_tree_split_child(tree, root, i);
+      /* In a B+tree the separator is the first element of the right node */
+      const int res = cmp(elem, node_items(root) + elem_size * i);
+      if (res > 0 || (res == 0 && node_plus(tree))) {
+        nextchild = node_children(tree, root)[++i];
       }
     }
-    node_insert_nonfull(nextchild, elem, degree, elem_size, cmp);
+    node_insert_nonfull(tree, nextchild, elem);
   }
 }
 
 /* Returns the new root, if a split occurs */
-struct node* node_insert(struct node* root, void* elem, const ssize_t degree,
-                         const size_t elem_size,
-                         int (*cmp)(const void* a, const void* b)) {
+struct btree_node* node_insert(const struct btree* tree,
+                               struct btree_node* root, void* elem) {
 
-  struct node* s = root;
+  struct btree_node* s = root;
 
-  if (node_full(degree, root)) {
-    s = node_new(degree, elem_size);
+  if (node_full(tree->degree, root)) {
+    s = node_new(tree, false);
     if (s == NULL) {
       fputs("BTree error: Failed to allocate new node for insertion!\n",
             stderr);
       return NULL;
     }
-    node_transition(s, degree);
-    s->children[s->c++] = root;
+    node_children(tree, s)[s->c++] = root;
+    s->count = root->count;
     /* TODO Check if the root has changed */
-    node_tree_split_child(degree, elem_size, s, 0);
-    node_insert_nonfull(s, elem, degree, elem_size, cmp);
+    node_tree_split_child(tree, s, 0);
+    node_insert_nonfull(tree, s, elem);
   } else {
-    node_insert_nonfull(s, elem, degree, elem_size, cmp);
+    node_insert_nonfull(tree, s, elem);
   }
   return s;
 }
 
-void* node_search(struct node* x, void* key,
-                  int (*cmp)(const void* a, const void* b),
-                  const size_t elem_size) {
-  /* We set to one, since we pre-emptively do a comparison with the assumption
-   * that there's already one in the items */
-  ssize_t i = 0;
-  int last_cmp_res = 0;
+void* node_search(const struct btree* tree, struct btree_node* x, void* key) {
+  const size_t elem_size = tree->elem_size;
+  ssize_t i = node_bound(tree, x, key, false);
 
-  while (i < x->n &&
-         (last_cmp_res = cmp(key, (const void*)(x->items + (i * elem_size)))) >
-             0) {
-    i++;
+  if (node_plus(tree)) {
+    if (!node_leaf(x)) {
+      /* Separators are only copies, the element is in a leaf */
+      return node_search(tree, node_children(tree, x)[i], key);
+    }
+    /* The lower bound may be the first element of the next leaf */
+    if (i == x->n && node_next(tree, x) != NULL) {
+      x = node_next(tree, x);
+      i = 0;
+    }
   }
 
-  if ((ssize_t)i < x->n && last_cmp_res == 0) {
-    return (void*)(x->items + (i * elem_size));
+  if (i < x->n && tree->cmp(key, node_items(x) + (i * elem_size)) == 0) {
+    return (void*)(node_items(x) + (i * elem_size));
   } else if (node_leaf(x)) {
     return NULL;
   }
 
   /* Assumption: ¬node_leaf(x) → x.children is allocated */
-  return node_search(x->children[i], key, cmp, elem_size);
+  return node_search(tree, node_children(tree, x)[i], key);
 }
 
-int node_delete(struct node* x, void* key,
-                int (*cmp)(const void* a, const void* b), const ssize_t degree,
-                const size_t elem_size, void* (*alloc)(size_t),
-                void (*dealloc)(void*)) {
-  /* Determine wether the key is in the node */
-  int i = 0; /* Index of `k`, if found */
-  int last_cmp_res = 0;
-
-  while (i < x->n &&
-         (last_cmp_res = cmp(key, (const void*)(x->items + (i * elem_size)))) >
-             0) {
-    i++;
-  }
-
-  if (last_cmp_res == 0) {
-
+/* `node_delete` deletes `key` from the subtree rooted at `x`, following CLRS.
+ * Every node we descend into has at least `t` items (except the root), so a
+ * deletion never has to walk back up to fix an underflowing node.
+ * returnvalue: 1 if `key` was found and deleted, 0 otherwise */
+int node_delete(const struct btree* tree, struct btree_node* x,
+                const void* key) {
+  const ssize_t degree = tree->degree;
+  const size_t elem_size = tree->elem_size;
+  ssize_t i = node_bound(tree, x, key, false); /* Index of `k`, if found */
+  byte* k = node_items(x) + (elem_size * i);
+  int res = 0;
+
+  node_write(tree, x);
+
+  if (i < x->n && tree->cmp(key, k) == 0) {
     if (node_leaf(x)) {
-      /* 1. k ϵ x && node_leaf(x) */
-      /* Delete k from x */
-      int j = i;
-      while (j + 1 < x->n) {
-        const size_t offset_dst = elem_size * j;
-        const size_t offset_src = elem_size * (j + 1);
-        memcpy((x->items) + offset_dst, (x->items) + offset_src, elem_size);
-        j++;
-      }
+      /* 1. k ϵ x && node_leaf(x): delete k from x */
+      memmove(k, k + elem_size, elem_size * (x->n - 1 - i));
       x->n--;
+      x->count--;
       return 1;
     } else {
       /* 2. k ϵ x && !node_leaf(x) */
-      /* let i be the index of k in x */
-      /* 2a: if size(child[i]) >= t; find the largest k' in child[i] */
-      /* replace k with k' */
-      if (x->children[i]->n >= degree) {
-        struct node* y = x->children[i];
-        byte* kk = alloc(elem_size);
+      struct btree_node* y = node_children(tree, x)[i];
+      struct btree_node* z = node_children(tree, x)[i + 1];
 
-        /* Find the predecessor, k' of k in y */
-        {
-          struct node* tmp = y;
-          while (!node_leaf(tmp)) {
-            tmp = tmp->children[tmp->n - 1];
-          }
+      if (y->n >= degree) {
+        /* 2a. replace k with its predecessor k', and delete k' from y */
+        struct btree_node* tmp = y;
+        while (!node_leaf(tmp)) tmp = node_children(tree, tmp)[tmp->c - 1];
 
-          /* copy kk */
-          memcpy(kk, tmp->items + elem_size * (tmp->n - 1), elem_size);
-        }
+        memcpy(k, node_items(tmp) + elem_size * (tmp->n - 1), elem_size);
+        res = node_delete(tree, y, k);
 
-        /* Recursively delete kk from y */
-        return node_delete(y, kk, cmp, degree, elem_size, alloc, dealloc);
+      } else if (z->n >= degree) {
+        /* 2b. replace k with its successor k', and delete k' from z */
+        struct btree_node* tmp = z;
+        while (!node_leaf(tmp)) tmp = node_children(tree, tmp)[0];
 
-        /* replace k with kk */
-        memcpy(x->items + (elem_size * i), kk, elem_size);
+        memcpy(k, node_items(tmp), elem_size);
+        res = node_delete(tree, z, k);
 
-        dealloc(kk);
+      } else {
+        /* 2c. merge k and z into y, and delete k from y */
+        node_child_merge(tree, x, i);
+        res = node_delete(tree, y, key);
+      }
+    }
+  } else if (node_leaf(x)) {
+    /*  if x is a leaf, then it is not in the tree */
+    return 0;
+  } else {
+    /* 3. !(k ϵ x): k can only be in x.c[i] */
+    struct btree_node* y = node_children(tree, x)[i];
 
-        return 1;
+    /* Make sure x.c[i] has at least t items before we descend */
+    if (y->n < degree) {
+      if (i > 0 && node_children(tree, x)[i - 1]->n >= degree) {
+        /* 3a. borrow an item from the left sibling */
+        node_shift_right(tree, x, i - 1);
 
-      } else if (x->children[i + 1]->n >= degree) {
-        struct node* z = x->children[i + 1];
-        byte* kk = alloc(elem_size);
+      } else if (i < x->n && node_children(tree, x)[i + 1]->n >= degree) {
+        /* 3a. borrow an item from the right sibling */
+        node_shift_left(tree, x, i);
 
-        /* Find the successor, k' of k in z */
-        {
-          struct node* tmp = z->children[0];
-          while (!node_leaf(tmp)) {
-            tmp = tmp->children[0];
-          }
+      } else if (i < x->n) {
+        /* 3b. merge with the right sibling */
+        node_child_merge(tree, x, i);
 
-          /* copy kk */
-          memcpy(kk, tmp->items + elem_size * (tmp->n - 1), elem_size);
-        }
+      } else {
+        /* 3b. merge with the left sibling */
+        node_child_merge(tree, x, i - 1);
+        y = node_children(tree, x)[i - 1];
+      }
+    }
 
-        /* Recursively delete kk from y */
-        return node_delete(z, kk, cmp, degree, elem_size, alloc, dealloc);
+    res = node_delete(tree, y, key);
+  }
 
-        /* replace k with kk */
-        memcpy(x->items + (elem_size * i), kk, elem_size);
+  x->count -= res;
+  return res;
+}
 
-        dealloc(kk);
+/* `node_leaf_merge` is `node_child_merge` for the leaves of a B+tree: the
+ * leaf right of separator `i` is appended to the one left of it, and the
+ * separator is dropped */
+static void node_leaf_merge(const struct btree* tree, struct btree_node* x,
+                            ssize_t i) {
+  const size_t elem_size = tree->elem_size;
+  struct btree_node* y = node_children(tree, x)[i];
+  struct btree_node* z = node_children(tree, x)[i + 1];
+
+  node_write(tree, x);
+  node_write(tree, y);
+  /* Readers still inside `z` have to retry */
+  node_write(tree, z);
+  node_write(tree, node_next(tree, z));
+
+  memcpy(node_items(y) + elem_size * y->n, node_items(z), elem_size * z->n);
+  y->n += z->n;
+  y->count += z->count;
 
-        return 1;
-      } else {
-        /* Merge k and z into y */
-        node_child_merge(x, i, elem_size, dealloc);
+  /* Unlink `z` */
+  node_next(tree, y) = node_next(tree, z);
+  if (node_next(tree, z) != NULL) node_prev(tree, node_next(tree, z)) = y;
 
-        /* recurse */
-        return node_delete(x->children[i], key, cmp, degree, elem_size, alloc,
-                           dealloc);
-      }
-    }
-  } else if (node_leaf(x)) {
-    return 0;
-  } else {
-    /* 3. !(k ϵ x) */
+  memmove(&node_children(tree, x)[i + 1], &node_children(tree, x)[i + 2],
+          sizeof(struct btree_node*) * (x->c - i - 2));
+  x->c--;
+  memmove(node_items(x) + elem_size * i, node_items(x) + elem_size * (i + 1),
+          elem_size * (x->n - 1 - i));
+  x->n--;
 
-    /*  if x is a leaf, then it is not in the tree */
+  node_retire(tree, z);
+}
 
-    struct node* y;
-    int ii; /* index of x.c[i] */
+/* `node_plus_fix` refills child `i` of `x` in a B+tree, if a deletion left it
+ * with less than `t - 1` items. It borrows an item from a sibling if one can
+ * spare it, and merges with a sibling otherwise. */
+static void node_plus_fix(const struct btree* tree, struct btree_node* x,
+                          ssize_t i) {
+  const ssize_t degree = tree->degree;
+  const size_t elem_size = tree->elem_size;
+  struct btree_node* y = node_children(tree, x)[i];
+  struct btree_node* left = i > 0 ? node_children(tree, x)[i - 1] : NULL;
+  struct btree_node* right = i < x->n ? node_children(tree, x)[i + 1] : NULL;
 
-    /* Determine x.c[i] that must contain k */
-    /* if last cmp < 0, then the child must be in the left child of x.items[i]*/
-    if (last_cmp_res < 0) ii = i;
-    /* Otherwise, it must be the very last child */
-    else if (i < x->n)
-      ii = i + 1;
-    else
-      ii = i;
+  if (y->n >= degree - 1) return;
 
-    y = x->children[ii];
+  if (!node_leaf(y)) {
+    /* Separators of internal nodes rotate through the parent as usual */
+    if (left != NULL && left->n >= degree) {
+      node_shift_right(tree, x, i - 1);
+    } else if (right != NULL && right->n >= degree) {
+      node_shift_left(tree, x, i);
+    } else if (right != NULL) {
+      node_child_merge(tree, x, i);
+    } else {
+      node_child_merge(tree, x, i - 1);
+    }
+    return;
+  }
 
-    if (y->n < degree) {
-      /* we are left biased */
-      if (ii > 0 && x->children[ii - 1]->n >= degree) {
-        node_shift_right(x, ii - 1, elem_size);
+  if (left != NULL && left->n >= degree) {
+    /* Move the last element of `left` to the front of `y` */
+    node_write(tree, x);
+    node_write(tree, y);
+    node_write(tree, left);
+    memmove(node_items(y) + elem_size, node_items(y), elem_size * y->n);
+    memcpy(node_items(y), node_items(left) + elem_size * --left->n,
+           elem_size);
+    y->n++;
+    y->count++;
+    left->count--;
+    memcpy(node_items(x) + elem_size * (i - 1), node_items(y), elem_size);
+
+  } else if (right != NULL && right->n >= degree) {
+    /* Move the first element of `right` to the back of `y` */
+    node_write(tree, x);
+    node_write(tree, y);
+    node_write(tree, right);
+    memcpy(node_items(y) + elem_size * y->n++, node_items(right), elem_size);
+    memmove(node_items(right), node_items(right) + elem_size,
+            elem_size * --right->n);
+    y->count++;
+    right->count--;
+    memcpy(node_items(x) + elem_size * i, node_items(right), elem_size);
+
+  } else if (right != NULL) {
+    node_leaf_merge(tree, x, i);
+  } else {
+    node_leaf_merge(tree, x, i - 1);
+  }
+}
 
-      } else if (ii < x->c - 1 && x->children[ii + 1]->n >= degree) {
-        node_shift_left(x, ii, elem_size);
+/* `node_plus_delete` deletes `key` from the subtree rooted at `x` in a
+ * B+tree. Unlike `node_delete` it fixes underflowing children on the way back
+ * up, since the element to delete is only known to be in a leaf.
+ * returnvalue: 1 if `key` was found and deleted, 0 otherwise */
+int node_plus_delete(const struct btree* tree, struct btree_node* x,
+                     const void* key) {
+  const size_t elem_size = tree->elem_size;
+  ssize_t i = node_bound(tree, x, key, false);
+  int res = 0;
+
+  if (node_leaf(x)) {
+    byte* k = node_items(x) + elem_size * i;
+    if (i == x->n || tree->cmp(key, k) != 0) return 0;
+
+    node_write(tree, x);
+    memmove(k, k + elem_size, elem_size * (x->n - 1 - i));
+    x->n--;
+    x->count--;
+    return 1;
+  }
 
-      } else {
-        /* We need to determine wether we merge left or right, if possible */
-        if (ii > 0) {
-          node_child_merge(x, ii - 1, elem_size, dealloc);
-          y = x->children[ii - 1];
-        } else if (ii < x->c - 1) {
-          node_child_merge(x, ii, elem_size, dealloc);
-        } else {
-          perror("Cannot merge!");
-        }
-      }
+  /* Elements equal to the separator can be on both sides of it */
+  for (;;) {
+    res = node_plus_delete(tree, node_children(tree, x)[i], key);
+    if (res || i == x->n ||
+        tree->cmp(key, node_items(x) + elem_size * i) != 0) {
+      break;
     }
+    i++;
+  }
 
-    return node_delete(y, key, cmp, degree, elem_size, alloc, dealloc);
+  if (res) {
+    node_write(tree, x);
+    x->count--;
+    node_plus_fix(tree, x, i);
   }
-  return 0;
+  return res;
 }
 
 /***********************/
@@ -519,31 +829,103 @@ int node_delete(struct node* x, void* key,
 /***********************/
 struct btree* btree_new(size_t elem_size, size_t t,
                         int (*cmp)(const void* a, const void* b)) {
-  return btree_new_with_allocator(elem_size, t, cmp, malloc, free);
+  const allocator a = allocator_malloc();
+  return btree_new_with_allocator(elem_size, t, cmp, &a);
 }
 
 struct btree* btree_new_with_allocator(size_t elem_size, size_t t,
                                        int (*cmp)(const void* a, const void* b),
-                                       void* (*alloc)(size_t),
-                                       void (*dealloc)(void*)) {
-  struct btree* new_tree = alloc(sizeof(struct btree));
+                                       const allocator* alloc) {
+  return btree_new_ex(elem_size, t, cmp, alloc, 0);
+}
+
+struct btree* btree_new_ex(size_t elem_size, size_t t,
+                           int (*cmp)(const void* a, const void* b),
+                           const allocator* alloc, int flags) {
+  struct btree* new_tree = allocator_alloc(alloc, sizeof(struct btree));
 
-  new_tree->alloc = alloc;
-  new_tree->dealloc = dealloc;
+  new_tree->alloc = *alloc;
 
   new_tree->elem_size = elem_size;
   new_tree->degree = t;
+  new_tree->flags = flags;
+
+  new_tree->children_offset =
+      BTREE_ALIGN(BTREE_NODE_HEADER_SIZE + node_items_size(t, elem_size),
+                  sizeof(struct btree_node*));
+  new_tree->leaf_size = BTREE_NODE_HEADER_SIZE + node_items_size(t, elem_size);
+  new_tree->internal_size =
+      new_tree->children_offset + node_children_size(t);
+
+  /* B+tree leaves keep the links of the leaf chain where the children of
+   * internal nodes would be */
+  if (flags & BTREE_PLUS) {
+    new_tree->leaf_size =
+        new_tree->children_offset + 2 * sizeof(struct btree_node*);
+  }
 
   new_tree->root = NULL;
 
+  new_tree->sync = NULL;
+  if (flags & BTREE_CONCURRENT) {
+    new_tree->sync = allocator_alloc(alloc, sizeof(struct btree_sync));
+    memset(new_tree->sync, 0, sizeof(struct btree_sync));
+  }
+
   new_tree->cmp = cmp;
+  new_tree->bound = NULL;
 
   return new_tree;
 }
 
+size_t btree_degree_from_size(size_t elem_size, size_t node_size) {
+  size_t t;
+
+  if (node_size < BTREE_SIZE_MIN) node_size = BTREE_SIZE_MIN;
+  if (node_size > BTREE_SIZE_MAX) node_size = BTREE_SIZE_MAX;
+
+  /* Solve `internal_size <= node_size` for t, with
+   * internal_size = header + 2t * elem_size + (2t + 1) * sizeof(node*)
+   * (ignoring the padding of the children, which is at most a pointer) */
+  if (node_size < BTREE_NODE_HEADER_SIZE + 2 * sizeof(struct btree_node*)) {
+    return 2;
+  }
+  t = (node_size - BTREE_NODE_HEADER_SIZE - 2 * sizeof(struct btree_node*)) /
+      (2 * (elem_size + sizeof(struct btree_node*)));
+
+  return t < 2 ? 2 : t;
+}
+
+void btree_reclaim(struct btree* btree) {
+  struct btree_sync* sync = btree->sync;
+  size_t i;
+
+  if (sync == NULL) return;
+
+  btree_write_begin(btree);
+  for (i = 0; i < sync->retired_len; i++) {
+    node_dealloc(btree, sync->retired[i]);
+  }
+  sync->retired_len = 0;
+  btree_write_end(btree);
+}
+
 void btree_free(struct btree** btree) {
-  node_free(&((*btree)->root), (*btree)->elem_size, (*btree)->dealloc);
-  (*btree)->dealloc(*btree);
+  allocator a = (*btree)->alloc;
+  struct btree_sync* sync = (*btree)->sync;
+
+  node_free(*btree, &((*btree)->root));
+
+  if (sync != NULL) {
+    btree_reclaim(*btree);
+    allocator_dealloc(&a, sync->locked,
+                      sync->locked_size * sizeof(struct btree_node*));
+    allocator_dealloc(&a, sync->retired,
+                      sync->retired_size * sizeof(struct btree_node*));
+    allocator_dealloc(&a, sync, sizeof(struct btree_sync));
+  }
+
+  allocator_dealloc(&a, *btree, sizeof(struct btree));
   *btree = NULL;
 }
 
@@ -556,39 +938,290 @@ void btree_insert(struct btree* btree, void* elem) {
     fputs("BTree error: Inserting NULL into a tree!\n", stderr);
     return;
   }
+
+  btree_write_begin(btree);
   if (btree->root == NULL) {
-    btree->root = node_new(btree->degree, btree->elem_size);
-    if (btree->root == NULL) {
+    struct btree_node* root = node_new(btree, true);
+    if (root == NULL) {
       fputs("BTree error: Failed to create new root node!\n", stderr);
+      btree_write_end(btree);
       return;
     }
-    node_insert(btree->root, elem, btree->degree, btree->elem_size, btree->cmp);
+    node_insert(btree, root, elem);
+    btree_set_root(btree, root);
   } else {
-    btree->root = node_insert(btree->root, elem, btree->degree,
-                              btree->elem_size, btree->cmp);
+    btree_set_root(btree, node_insert(btree, btree->root, elem));
   }
+  btree_write_end(btree);
 }
 
 void* btree_search(struct btree* btree, void* elem) {
-  return node_search(btree->root, elem, btree->cmp, btree->elem_size);
+  if (btree->root == NULL) return NULL;
+  return node_search(btree, btree->root, elem);
+}
+
+/* `node_read_begin` waits until `x` is not locked by a writer.
+ * returnvalue: the version to validate the reads from `x` against */
+static unsigned int node_read_begin(const struct btree_node* x) {
+  unsigned int v;
+  while ((v = __atomic_load_n(&x->version, __ATOMIC_ACQUIRE)) & 1) {
+    btree_pause();
+  }
+  return v;
+}
+
+/* `node_read_valid` checks that `x` has not changed since `node_read_begin`
+ * returned `v`, so everything read from it in between is consistent */
+static bool node_read_valid(const struct btree_node* x, unsigned int v) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&x->version, __ATOMIC_RELAXED) == v;
+}
+
+/* `btree_search_optimistic` is one attempt of `btree_search_concurrent`.
+ * Every node is validated after reading from it, and a child is only entered
+ * after its parent was validated again, so a concurrent writer at most causes
+ * a retry.
+ * returnvalue: 1 if found, 0 if not found, -1 if the caller should retry */
+static int btree_search_optimistic(struct btree* btree, const void* elem,
+                                   void* out) {
+  const size_t elem_size = btree->elem_size;
+  struct btree_node* x = __atomic_load_n(&btree->root, __ATOMIC_ACQUIRE);
+  unsigned int v;
+
+  if (x == NULL) return 0;
+
+  v = node_read_begin(x);
+  if (__atomic_load_n(&btree->root, __ATOMIC_ACQUIRE) != x) return -1;
+
+  for (;;) {
+    const ssize_t i = node_bound(btree, x, elem, false);
+    const byte* k = node_items(x) + elem_size * i;
+    struct btree_node* next;
+    unsigned int next_v;
+
+    /* B+tree separators are only copies */
+    if ((node_leaf(x) || !node_plus(btree)) && i < x->n &&
+        btree->cmp(elem, k) == 0) {
+      memcpy(out, k, elem_size);
+      return node_read_valid(x, v) ? 1 : -1;
+    }
+
+    if (!node_leaf(x)) {
+      next = node_children(btree, x)[i];
+    } else if (node_plus(btree) && i == x->n) {
+      /* The lower bound may be the first element of the next leaf */
+      next = node_next(btree, x);
+    } else {
+      next = NULL;
+    }
+
+    if (!node_read_valid(x, v)) return -1;
+    if (next == NULL) return 0;
+
+    next_v = node_read_begin(next);
+    if (!node_read_valid(x, v)) return -1;
+
+    x = next;
+    v = next_v;
+  }
+}
+
+bool btree_search_concurrent(struct btree* btree, const void* elem,
+                             void* out) {
+  int res;
+
+  while ((res = btree_search_optimistic(btree, elem, out)) < 0) {
+  }
+  return res == 1;
 }
 
 int btree_delete(struct btree* btree, void* elem) {
-  struct node* newroot = btree->root;
-  int res = node_delete(btree->root, elem, btree->cmp, btree->degree,
-                        btree->elem_size, btree->alloc, btree->dealloc);
-  if (newroot->n == 0) {
-    if (node_leaf(newroot)) return res;
+  struct btree_node* newroot;
+  int res;
+
+  /* Another writer may replace the root until the latch is held */
+  btree_write_begin(btree);
+  newroot = btree->root;
+  if (newroot == NULL) {
+    btree_write_end(btree);
+    return 0;
+  }
+
+  if (node_plus(btree)) {
+    res = node_plus_delete(btree, btree->root, elem);
+  } else {
+    res = node_delete(btree, btree->root, elem);
+  }
+  if (newroot->n == 0 && !node_leaf(newroot)) {
     /* shrink the tree */
-    struct node* newroot_p = newroot->children[0];
-    btree->dealloc(newroot);
-    btree->root = newroot_p;
+    btree_set_root(btree, node_children(btree, newroot)[0]);
+    node_retire(btree, newroot);
   }
+  btree_write_end(btree);
   return res;
 }
 
-void node_print(struct node* root, const size_t elem_size, const int indent,
-                void (*print_elem)(const void*)) {
+/* `btree_bulk_level` packs `m` sorted items, and `m + 1` children unless
+ * `children` is NULL, into `k` nodes of one level. The `k - 1` items that
+ * separate the nodes are copied to `seps`.
+ * Every node gets `(m - (k - 1)) / k` items, give or take one. The leaves of
+ * a B+tree keep all `m` items, and their separators are copies. */
+static void btree_bulk_level(struct btree* tree, const byte* items, size_t m,
+                             struct btree_node** children, size_t k,
+                             struct btree_node** nodes, byte* seps) {
+  const size_t elem_size = tree->elem_size;
+  const bool plus_leaves = node_plus(tree) && children == NULL;
+  const size_t kept = plus_leaves ? m : m - (k - 1);
+  const size_t per_node = kept / k;
+  const size_t extra = kept % k;
+  size_t j;
+
+  for (j = 0; j < k; j++) {
+    const size_t s = per_node + (j < extra);
+    struct btree_node* x = node_new(tree, children == NULL);
+
+    memcpy(node_items(x), items, elem_size * s);
+    x->n = s;
+    x->count = node_own_count(tree, x);
+    items += elem_size * s;
+
+    if (children != NULL) {
+      memcpy(node_children(tree, x), children, sizeof(*children) * (s + 1));
+      x->c = s + 1;
+      x->count += node_count_children(tree, x, 0, x->c);
+      children += s + 1;
+    }
+
+    if (j + 1 < k) {
+      memcpy(seps + elem_size * j, items, elem_size);
+      if (!plus_leaves) items += elem_size;
+    }
+
+    if (plus_leaves && j > 0) {
+      node_next(tree, nodes[j - 1]) = x;
+      node_prev(tree, x) = nodes[j - 1];
+    }
+    nodes[j] = x;
+  }
+}
+
+void btree_bulk_load(struct btree* btree, const void* sorted, size_t n) {
+  const allocator* a = &btree->alloc;
+  const size_t elem_size = btree->elem_size;
+  const size_t per_node = 2 * btree->degree; /* items + separator */
+  const byte* items = sorted;
+  byte* items_buf = NULL;
+  struct btree_node** children = NULL;
+  struct btree_node* root;
+  size_t m = n;
+  size_t i;
+
+  if (n == 0) return;
+
+  btree_write_begin(btree);
+
+  if (btree_size(btree) > 0) {
+    /* Not a fresh tree, fall back to inserting the items one by one. The
+     * inserts take the latch themselves. */
+    btree_write_end(btree);
+    for (i = 0; i < n; i++) btree_insert(btree, (void*)(items + elem_size * i));
+    return;
+  }
+
+  /* Nodes are built privately and only published once complete */
+  if (btree->root != NULL) node_retire(btree, btree->root);
+  root = NULL;
+
+  /* Build the tree level by level, the separators of one level are the items
+   * of the next. Packing `m` items into `ceil((m + 1) / 2t)` nodes keeps each
+   * node between `t - 1` and `2t - 1` items. B+tree leaves keep their
+   * separators, so they take `ceil(m / (2t - 1))` leaves. */
+  for (;;) {
+    const size_t k = node_plus(btree) && children == NULL
+                         ? (m + per_node - 2) / (per_node - 1)
+                         : (m + per_node) / per_node;
+    struct btree_node** nodes;
+    byte* seps;
+
+    if (k == 1) {
+      btree_bulk_level(btree, items, m, children, 1, &root, NULL);
+      break;
+    }
+
+    nodes = allocator_alloc(a, sizeof(*nodes) * k);
+    seps = allocator_alloc(a, elem_size * (k - 1));
+    btree_bulk_level(btree, items, m, children, k, nodes, seps);
+
+    if (children != NULL) {
+      allocator_dealloc(a, children, sizeof(*children) * (m + 1));
+      allocator_dealloc(a, items_buf, elem_size * m);
+    }
+    items = items_buf = seps;
+    children = nodes;
+    m = k - 1;
+  }
+
+  if (children != NULL) {
+    allocator_dealloc(a, children, sizeof(*children) * (m + 1));
+    allocator_dealloc(a, items_buf, elem_size * m);
+  }
+
+  btree_set_root(btree, root);
+  btree_write_end(btree);
+}
+
+/* `btree_sorted_copy` returns a copy of `elems`, sorted with the trees
+ * comparison function */
+static byte* btree_sorted_copy(struct btree* btree, const void* elems,
+                               size_t n) {
+  byte* sorted = allocator_alloc(&btree->alloc, btree->elem_size * n);
+
+  memcpy(sorted, elems, btree->elem_size * n);
+  qsort(sorted, n, btree->elem_size, btree->cmp);
+
+  return sorted;
+}
+
+void btree_insert_batch(struct btree* btree, const void* elems, size_t n) {
+  byte* sorted;
+  size_t i;
+
+  if (n == 0) return;
+
+  sorted = btree_sorted_copy(btree, elems, n);
+
+  if (btree_size(btree) == 0) {
+    btree_bulk_load(btree, sorted, n);
+  } else {
+    /* In key order, consecutive descents share most of their path, which is
+     * still in cache from the previous insertion */
+    for (i = 0; i < n; i++) {
+      btree_insert(btree, sorted + btree->elem_size * i);
+    }
+  }
+
+  allocator_dealloc(&btree->alloc, sorted, btree->elem_size * n);
+}
+
+size_t btree_delete_batch(struct btree* btree, const void* elems, size_t n) {
+  byte* sorted;
+  size_t deleted = 0;
+  size_t i;
+
+  if (n == 0) return 0;
+
+  sorted = btree_sorted_copy(btree, elems, n);
+  for (i = 0; i < n; i++) {
+    deleted += btree_delete(btree, sorted + btree->elem_size * i);
+  }
+  allocator_dealloc(&btree->alloc, sorted, btree->elem_size * n);
+
+  return deleted;
+}
+
+void node_print(const struct btree* tree, struct btree_node* root,
+                const int indent, void (*print_elem)(const void*)) {
+  const size_t elem_size = tree->elem_size;
   ssize_t i;
   int t;
 
@@ -610,62 +1243,62 @@ void node_print(struct node* root, const size_t elem_size, const int indent,
       for (t = 0; t < indent; t++) {
         fputs(" ┃├", stdout);
       }
-      print_elem(root->items + ofst);
+      print_elem(node_items(root) + ofst);
     }
     for (t = 0; t < indent; t++) {
       fputs(" ┃└", stdout);
     }
-    print_elem(root->items + i * elem_size);
+    print_elem(node_items(root) + i * elem_size);
   } else {
     size_t ofst = 0;
     for (i = 0; i < root->c - 1; i++) {
-      node_print(root->children[i], elem_size, indent + 1, print_elem);
+      node_print(tree, node_children(tree, root)[i], indent + 1, print_elem);
       for (t = 0; t < indent; t++) {
         fputs(" ┃ ", stdout);
       }
-      print_elem(root->items + ofst);
+      print_elem(node_items(root) + ofst);
       ofst += elem_size;
     }
-    node_print(root->children[i], elem_size, indent + 1, print_elem);
+    node_print(tree, node_children(tree, root)[i], indent + 1, print_elem);
   }
 }
 
 void btree_print(struct btree* btree, void (*print_elem)(const void*)) {
   printf("BTRee: degree:%ld\n", btree->degree);
   if (btree->root == NULL) return;
-  node_print(btree->root, btree->elem_size, 0, print_elem);
+  node_print(btree, btree->root, 0, print_elem);
 }
 
 void* btree_first(struct btree* btree) {
-  struct node* root;
+  struct btree_node* root;
   if (btree == NULL) return NULL;
   root = btree->root;
 
   if (root == NULL) return NULL;
 
-  while (!node_leaf(root)) root = root->children[0];
+  while (!node_leaf(root)) root = node_children(btree, root)[0];
 
   if (root->n == 0) return NULL;
-  return root->items; /* Return first element */
+  return node_items(root); /* Return first element */
 }
 
 void* btree_last(struct btree* btree) {
-  struct node* root;
+  struct btree_node* root;
 
   if (btree == NULL) return NULL;
   root = btree->root;
 
   if (root == NULL) return NULL;
 
-  while (!node_leaf(root)) root = root->children[root->c];
+  while (!node_leaf(root)) root = node_children(btree, root)[root->c - 1];
 
   if (root->n == 0) return NULL;
-  return root->items +
+  return node_items(root) +
          btree->elem_size * (root->n - 1); /* Return first element */
 }
 
 size_t btree_height(struct btree* btree) {
-  struct node* root;
+  struct btree_node* root;
   size_t height = 0;
 
   if (btree == NULL) return 0;
@@ -674,127 +1307,269 @@ size_t btree_height(struct btree* btree) {
   if (root == NULL) return 0;
 
   while (!node_leaf(root)) {
-    root = root->children[0];
+    root = node_children(btree, root)[0];
     height++;
   }
 
   return height;
 }
 
-size_t u32_pow(size_t base, size_t exponent) {
-  size_t res = 1;
-  while (exponent > 0) {
-    res *= base;
-    exponent--;
-  }
-  return res;
+struct btree_node* btree_root(struct btree* btree) {
+  if (btree == NULL) return NULL;
+  return btree->root;
+}
+
+int btree_flags(struct btree* btree) {
+  if (btree == NULL) return 0;
+  return btree->flags;
+}
+
+void btree_set_bound(struct btree* btree, btree_bound_fn bound) {
+  if (btree == NULL) return;
+  btree->bound = bound;
+}
+
+size_t btree_children_offset(struct btree* btree) {
+  if (btree == NULL) return 0;
+  return btree->children_offset;
 }
 
 size_t btree_size(struct btree* btree) {
-  return u32_pow(2 * btree->degree, btree_height(btree)) - 1;
+  if (btree == NULL || btree->root == NULL) return 0;
+  return btree->root->count;
 }
 
-struct btree_iter_t* btree_iter_t_new(struct btree* tree) {
-  struct btree_iter_t* iter = NULL;
+size_t btree_rank(struct btree* btree, const void* elem) {
+  struct btree_node* x;
+  size_t rank = 0;
+
+  if (btree == NULL) return 0;
+
+  x = btree->root;
+  while (x != NULL) {
+    /* Everything left of `i` is less than `elem` */
+    const ssize_t i = node_bound(btree, x, elem, false);
+    rank += (node_leaf(x) ? i : i * node_sep_count(btree)) +
+            node_count_children(btree, x, 0, i);
+
+    if (node_leaf(x)) break;
+    x = node_children(btree, x)[i];
+  }
+
+  return rank;
+}
+
+void* btree_select(struct btree* btree, size_t k) {
+  struct btree_node* x;
+
+  if (k >= btree_size(btree)) return NULL;
+
+  x = btree->root;
+  while (!node_leaf(x)) {
+    ssize_t j;
+    for (j = 0; j < x->c; j++) {
+      const size_t c = node_children(btree, x)[j]->count;
+      if (k < c) break;
+      k -= c;
+      /* The item right of child j, which is only a copy in a B+tree */
+      if (node_plus(btree)) continue;
+      if (k == 0) return node_items(x) + btree->elem_size * j;
+      k--;
+    }
+    x = node_children(btree, x)[j];
+  }
 
-  if (tree == NULL) return NULL;
+  return node_items(x) + btree->elem_size * k;
+}
 
-  iter = (struct btree_iter_t*)tree->alloc(sizeof(struct btree_iter_t));
+/* `btree_iter_alloc` makes sure `*it` can hold a path from the root to a leaf.
+ * A NULL `*it` is allocated. */
+static void btree_iter_alloc(struct btree* tree, struct btree_iter_t** it) {
+  const size_t depth = btree_height(tree) + 1;
 
-  if (tree != NULL) {
-    iter->head = 0;
-    memset(iter->stack, 0, 512 * sizeof(struct node*));
+  if (*it != NULL && (*it)->depth >= depth) return;
 
-    iter->stack[iter->head].pos = 0;
-    iter->stack[iter->head].node = tree->root;
+  if (*it == NULL) {
+    *it = allocator_alloc(&tree->alloc, btree_iter_size(depth));
   } else {
+    *it = allocator_realloc(&tree->alloc, *it, btree_iter_size((*it)->depth),
+                            btree_iter_size(depth));
+  }
+  (*it)->depth = depth;
+}
+
+/* `btree_iter_descend` pushes the path from the subtree at `x` to the leaf
+ * containing `key`. Each node is entered at its lower bound of `key`, or its
+ * upper bound with `upper`. A NULL `key` descends to the first leaf. */
+static void btree_iter_descend(struct btree* tree, struct btree_iter_t* it,
+                               struct btree_node* x, const void* key,
+                               bool upper) {
+  while (x != NULL) {
+    const ssize_t pos = key == NULL ? 0 : node_bound(tree, x, key, upper);
+
+    it->stack[it->head].pos = pos;
+    it->stack[it->head].node = x;
+    it->head++;
+
+    if (node_leaf(x)) break;
+    x = node_children(tree, x)[pos];
+  }
+}
+
+/* `btree_iter_descend_last` pushes the path from `x` to the end of its last
+ * leaf */
+static void btree_iter_descend_last(struct btree* tree,
+                                    struct btree_iter_t* it,
+                                    struct btree_node* x) {
+  while (x != NULL) {
+    const ssize_t pos = node_leaf(x) ? x->n : x->c - 1;
+
+    it->stack[it->head].pos = pos;
+    it->stack[it->head].node = x;
+    it->head++;
+
+    if (node_leaf(x)) break;
+    x = node_children(tree, x)[pos];
+  }
+}
+
+static struct btree_iter_t* btree_iter_seek(struct btree* tree,
+                                            const void* key, bool upper) {
+  struct btree_iter_t* iter = NULL;
+
+  if (tree == NULL) {
     perror("Cannot instantiate iterator from null-pointer tree");
+    return NULL;
   }
+
+  btree_iter_alloc(tree, &iter);
+  iter->head = 0;
+  btree_iter_descend(tree, iter, tree->root, key, upper);
+
   return iter;
 }
 
+struct btree_iter_t* btree_iter_t_new(struct btree* tree) {
+  return btree_iter_seek(tree, NULL, false);
+}
+
+struct btree_iter_t* btree_lower_bound(struct btree* tree, const void* elem) {
+  return btree_iter_seek(tree, elem, false);
+}
+
+struct btree_iter_t* btree_upper_bound(struct btree* tree, const void* elem) {
+  return btree_iter_seek(tree, elem, true);
+}
+
+void btree_iter_t_free(struct btree* tree, struct btree_iter_t** it) {
+  if (*it == NULL) return;
+  allocator_dealloc(&tree->alloc, *it, btree_iter_size((*it)->depth));
+  *it = NULL;
+}
+
 void btree_iter_t_reset(struct btree* tree, struct btree_iter_t** it) {
+  btree_iter_alloc(tree, it);
   (*it)->head = 0;
+  btree_iter_descend(tree, *it, tree->root, NULL, false);
+}
 
-  (*it)->stack[0].pos = 0;
-  (*it)->stack[0].node = tree->root;
+void btree_iter_t_reset_end(struct btree* tree, struct btree_iter_t** it) {
+  btree_iter_alloc(tree, it);
+  (*it)->head = 0;
+  btree_iter_descend_last(tree, *it, tree->root);
 }
 
+/* The iterator is a cursor between two elements. The top of the stack is a
+ * leaf and the position of the cursor within it. Every other entry holds the
+ * index of the child we descended into, which is also the index of the next
+ * item in that node once the child is exhausted. */
 void* btree_iter(struct btree* tree, struct btree_iter_t* iter) {
-  register int pos = 0;
-  register ssize_t head = 0;
-  register ssize_t n = 0;
-
-  if (iter->stack[head].node == NULL) return NULL;
-
-  head = iter->head;
-  pos = iter->stack[head].pos;
-  n = iter->stack[head].node->n;
-
-#define BTREE_ITER_POP(it)                                                     \
-  {                                                                            \
-    iter->stack[head].pos = 0;                                                 \
-    iter->stack[head].node = NULL;                                             \
-    iter->head--;                                                              \
-    head--;                                                                    \
-    iter->stack[head].pos++;                                                   \
-                                                                               \
-    pos = iter->stack[head].pos;                                               \
-    n = iter->stack[head].node->n;                                             \
-  }
-
-  /* Check if we have reached the end of a node.
-   * Take note of the difference of inequality in the if statement and
-   * following while */
-
-  /* Leafs are a special case, as, if the only node is the root node, we might
-   * want to exit */
-  if (node_leaf(iter->stack[iter->head].node) && pos >= 2 * n) {
-    if (head == 0) return NULL;
-
-    /* Pop, if so */
-    else
-      BTREE_ITER_POP(iter);
-  }
-
-  /* Otherwise, pop while we have reached the end of a node */
-  while (pos > 2 * n) {
-    if (head == 0) return NULL;
-
-    /* Pop, if so */
-    else
-      BTREE_ITER_POP(iter);
-  }
-
-#undef BTREE_ITER_POP
-
-  /* On evens, we decent into children */
-  if (!node_leaf(iter->stack[head].node)) {
-    if (pos % 2 == 0) {
-      /* push child node onto iter->stack */
-      iter->stack[head + 1].pos = 0;
-      iter->stack[head + 1].node = iter->stack[head].node->children[pos / 2];
-      iter->head++;
-      head++;
-
-      /* Decent all the way to the left, if pos == 0 */
-      while (!node_leaf(iter->stack[iter->head].node)) {
-        iter->stack[head + 1].pos = 0;
-        iter->stack[head + 1].node = iter->stack[head].node->children[0];
-        iter->head++;
-        head++;
-      }
+  struct btree_iter_t_frame* top;
+  ssize_t h;
+
+  if (iter->head == 0) return NULL;
+
+  top = &iter->stack[iter->head - 1];
+  if (top->pos < top->node->n) {
+    return node_items(top->node) + tree->elem_size * top->pos++;
+  }
+
+  if (node_plus(tree)) {
+    /* All elements are in the leaves, so just follow the leaf chain */
+    struct btree_node* next = node_next(tree, top->node);
+    if (next == NULL) return NULL;
+
+    top->node = next;
+    top->pos = 1;
+    return node_items(next);
+  }
+
+  /* Find the nearest ancestor with items left */
+  for (h = iter->head - 2; h >= 0; h--) {
+    struct btree_iter_t_frame* f = &iter->stack[h];
+    if (f->pos < f->node->n) {
+      byte* elem = node_items(f->node) + tree->elem_size * f->pos;
+
+      /* Move to the start of the subtree right of `elem` */
+      f->pos++;
+      iter->head = h + 1;
+      btree_iter_descend(tree, iter, node_children(tree, f->node)[f->pos],
+                         NULL, false);
+      return elem;
     }
   }
 
-  /* Finally, update index and return a value */
-  if (node_leaf(iter->stack[head].node)) {
-    iter->stack[head].pos += 2;
-    pos = iter->stack[head].pos;
-  } else {
-    iter->stack[head].pos++;
-    pos = iter->stack[head].pos;
+  /* At the end, the cursor stays put */
+  return NULL;
+}
+
+void* btree_iter_prev(struct btree* tree, struct btree_iter_t* iter) {
+  struct btree_iter_t_frame* top;
+  ssize_t h;
+
+  if (iter->head == 0) return NULL;
+
+  top = &iter->stack[iter->head - 1];
+  if (top->pos > 0) {
+    return node_items(top->node) + tree->elem_size * --top->pos;
   }
 
-  return iter->stack[head].node->items + tree->elem_size * ((pos - 1) / 2);
+  if (node_plus(tree)) {
+    struct btree_node* prev = node_prev(tree, top->node);
+    if (prev == NULL) return NULL;
+
+    top->node = prev;
+    top->pos = prev->n - 1;
+    return node_items(prev) + tree->elem_size * top->pos;
+  }
+
+  /* Find the nearest ancestor with items before the cursor */
+  for (h = iter->head - 2; h >= 0; h--) {
+    struct btree_iter_t_frame* f = &iter->stack[h];
+    if (f->pos > 0) {
+      byte* elem = node_items(f->node) + tree->elem_size * (f->pos - 1);
+
+      /* Move to the end of the subtree left of `elem` */
+      f->pos--;
+      iter->head = h + 1;
+      btree_iter_descend_last(tree, iter,
+                              node_children(tree, f->node)[f->pos]);
+      return elem;
+    }
+  }
+
+  /* At the start, the cursor stays put */
+  return NULL;
+}
+
+void* btree_iter_until(struct btree* tree, struct btree_iter_t* iter,
+                       const void* end) {
+  void* elem = btree_iter(tree, iter);
+
+  if (elem == NULL) return NULL;
+  if (tree->cmp(elem, end) < 0) return elem;
+
+  /* Put `elem` back, so the iterator can be continued past `end` */
+  btree_iter_prev(tree, iter);
+  return NULL;
 }
@@ -19,7 +19,9 @@
 #define ENGINE_INTERNALS
 #include <engine/btree.h>
 #include <engine/engine.h>
+#include <engine/fov.h>
 #include <engine/hashmap.h>
+#include <engine/intern.h>
 #include <engine/list.h>
 
 #include <engine/state.h>
@@ -193,7 +195,7 @@ Platform* engine_init(const char* windowtitle, v2_i32 windowsize,
         windowtitle, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
         windowsize.x, windowsize.y,
         SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN | SDL_WINDOW_INPUT_FOCUS |
-            SDL_WINDOW_MOUSE_FOCUS | flags);
+            SDL_WINDOW_MOUSE_FOCUS | (flags & ~ENGINE_FLAG_HUGEPAGES));
 
     if (window == NULL) {
       ERROR("failed to create window: %s\n", SDL_GetError());
@@ -338,7 +340,16 @@ Platform* engine_init(const char* windowtitle, v2_i32 windowsize,
   p->frame = 0;
   p->fps_target = 60;
 
-  p->mem = memory_new(initial_memory);
+  /* State memory is only reserved here, pages are committed as they're used */
+  p->mem = memory_new_ex(
+      initial_memory,
+      MEMORY_RESERVE | (flags & ENGINE_FLAG_HUGEPAGES ? MEMORY_HUGEPAGES : 0));
+  p->frame_mem = memory_new(FRAME_MEMORY_SIZE);
+
+#ifdef BENCHMARK
+  memory_stats_enable(p->mem);
+  memory_stats_enable(p->frame_mem);
+#endif
 
   /* Getting the mouse coords now resolves the issue where a click "isn't
    * registered" when the mouse isn't moved before the user clicks */
@@ -429,6 +440,9 @@ i32 engine_run(Platform* p, StateType initial_state) {
 
   /* Main loop */
   do {
+    /* Everything allocated from the frame memory is dropped here */
+    memory_reset(p->frame_mem);
+
     const u32 now = SDL_GetTicks();
     const u64 dt = now - time;
     time = now;
@@ -467,6 +481,16 @@ i32 engine_run(Platform* p, StateType initial_state) {
           100.0f * (f32)profile_input_handling / (f32)sum,
           100.0f * (f32)profile_gameloop / (f32)sum,
           time - profile_interval_timer - sum, sum, drawcalls);
+      {
+        /* Enabling stats fails when they cannot be allocated */
+        const memory_stats* state_stats = memory_stats_get(mem);
+        const memory_stats* frame_stats = memory_stats_get(p->frame_mem);
+        if (state_stats != NULL && frame_stats != NULL) {
+          LOG("state memory peak:%lu KiB\t"
+              "frame memory peak:%lu KiB",
+              state_stats->peak / 1024, frame_stats->peak / 1024);
+        }
+      }
       /* Reset values */
       profile_tick_counter = ticks;
       profile_interval_timer = time;
@@ -640,8 +664,15 @@ i32 engine_run(Platform* p, StateType initial_state) {
       drawcall_reset();
 
       engine_window_resize_pointers_reset();
+#ifdef BENCHMARK
+      memory_stats_log(mem, StateTypeStr[state]);
+#endif
       State_free(state, mem);
       memory_clear(mem);
+#ifdef BENCHMARK
+      /* After the clear, so the next state's peak starts from zero */
+      memory_stats_reset(mem);
+#endif
 
       engine_input_ctx_reset();
 
@@ -711,6 +742,8 @@ void stop(Platform* p) {
     }
   }
 
+  fov_free();
+
   TTF_Quit();
   IMG_Quit();
   SDL_Quit();
@@ -744,12 +777,14 @@ void engine_input_ctx_push(i_ctx* ctx) {
       break;
 
     case InputType_action:
-      LOG("(action) %s", ctx->bindings[i].action.action.callback_str);
+      LOG("(action) %s",
+          intern_str(ctx->bindings[i].action.action.callback_id));
       break;
 
     case InputType_state:
-      LOG("(+state) %s", ctx->bindings[i].action.state.activate_str);
-      LOG("(-state) %s", ctx->bindings[i].action.state.deactivate_str);
+      LOG("(+state) %s", intern_str(ctx->bindings[i].action.state.activate_id));
+      LOG("(-state) %s",
+          intern_str(ctx->bindings[i].action.state.deactivate_id));
       break;
     case InputType_range:
       LOG("(range) --unhandled--");
@@ -777,3 +812,4 @@ void engine_input_ctx_reset(void) {
 u32 get_time(void) { return SDL_GetTicks(); }
 v2_i32 get_windowsize(void) { return GLOBAL_PLATFORM->window->windowsize; }
 v2_i32* get_mousepos(void) { return &GLOBAL_PLATFORM->mouse_pos; }
+memory* memory_frame(void) { return GLOBAL_PLATFORM->frame_mem; }
@@ -1,94 +1,510 @@
+#include <SDL2/SDL.h>
 #include <engine/fov.h>
+#include <engine/logging.h>
+#include <engine/stack.h>
 #include <engine/utils.h>
 #include <math.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
-void fov_shadowcast_rec(const void* map, const v2_i32 mapsize,
-                        bool (*visblocking)(const void*), i32* lightmap,
-                        const i32 range, v2_i32 src, const i32 row, f32 start,
-                        const f32 end, const i8 xx, const i8 xy, const i8 yx,
-                        const i8 yy) {
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
-  if (start < end) return;
+/* Tables of ranges up to this are found by index, larger ones in a list */
+#define FOV_TABLE_RANGE_MAX 256
 
-  const i32 range_2 = range * range;
-  f32 new_start = start;
+/* Light of cells outside the radius */
+#define FOV_OUT_OF_RANGE INT32_MIN
 
-  for (i32 i = row; i <= range; i++) {
-    i32 dx = (-1 * i) - 1;
-    i32 dy = -1 * i;
+/* `fov_lightmap_multi` uses a thread per this many sources, up to the number
+ * of cores and `FOV_THREADS_MAX`, the calling thread being one of them */
+#define FOV_SOURCES_PER_THREAD 4
+#define FOV_THREADS_MAX 32
 
-    bool blocked = false;
+/* Everything about a cell that only depends on its offset from the source.
+ * Cells are stored per row of an octant, row `i` holds the cells at
+ * dx = -i..0, dy = -i, see `fov_cell_index`. */
+typedef struct fov_cell {
+  f32 slope_l;
+  f32 slope_r;
+  i32 light; /* light at this offset, or `FOV_OUT_OF_RANGE` */
+} fov_cell;
 
-    while (dx <= 0) {
-      dx += 1;
+typedef struct fov_table {
+  i32 range;
+  struct fov_table* next; /* in `fov_tables_large` */
+  fov_cell cells[];
+} fov_table;
 
-      const i32 mapx = src.x + dx * xx + dy * xy;
-      const i32 mapy = src.y + dx * yx + dy * yy;
+/* A row of an octant that is yet to be scanned, between two slopes */
+typedef struct fov_row {
+  i32 row;
+  f32 start;
+  f32 end;
+} fov_row;
 
-      const f32 slope_l = (((f32)dx) - 0.5f) / (((f32)dy) + 0.5f);
-      const f32 slope_r = (((f32)dx) + 0.5f) / (((f32)dy) - 0.5f);
+/* Tables are built once per range, and kept until `fov_free` */
+static fov_table* fov_tables[FOV_TABLE_RANGE_MAX + 1];
+static fov_table* fov_tables_large;
 
-      if (start < slope_r) continue;
-      if (end > slope_l) break;
+#define fov_cell_index(i, dx) ((i) * ((i) + 1) / 2 + (i) + (dx))
 
-      if (dx * dx + dy * dy < range_2) {
-        /* set as visible */
-        if (mapx >= 0 && mapx < (long)mapsize.x && mapy >= 0 &&
-            mapy < (long)mapsize.y) {
-          // TODO: Calculate proper dist from source
-          f32 x_2 = (src.x - mapx) * (src.x - mapx);
-          f32 y_2 = (src.y - mapy) * (src.y - mapy);
-          lightmap[mapy * mapsize.x + mapx] =
-              MAX(lightmap[mapy * mapsize.x + mapx],
-                  range - sqrt((f32)(x_2 + y_2)));
-        }
+static fov_table* fov_table_new(const i32 range) {
+  const usize len = fov_cell_index(range + 1, 0);
+  fov_table* t = malloc(sizeof(fov_table) + len * sizeof(fov_cell));
+
+  if (t == NULL) {
+    ERROR("Failed to allocate fov table for range %d", range);
+    exit(EXIT_FAILURE);
+  }
+
+  t->range = range;
+  t->next = NULL;
+  for (i32 i = 0; i <= range; i++) {
+    const i32 dy = -i;
+    for (i32 dx = -i; dx <= 0; dx++) {
+      fov_cell* c = &t->cells[fov_cell_index(i, dx)];
+
+      /* Same expressions as evaluated per cell before, so the results are
+       * bit-identical */
+      c->slope_l = (((f32)dx) - 0.5f) / (((f32)dy) + 0.5f);
+      c->slope_r = (((f32)dx) + 0.5f) / (((f32)dy) - 0.5f);
+
+      if (dx * dx + dy * dy < range * range) {
+        const f32 x_2 = dx * dx;
+        const f32 y_2 = dy * dy;
+        c->light = range - sqrt((f32)(x_2 + y_2));
+      } else {
+        c->light = FOV_OUT_OF_RANGE;
       }
+    }
+  }
 
-      /* sizeof(i32) is the size of enums */
-      /* -- unless the compiler doesn't follow standard behaviour */
-      const bool is_blocked = visblocking(
-          (void*)((u64)map + sizeof(i32)                     /* ~ enum size */
-                                 * (mapsize.x * mapy + mapx) /* index */
-                  ));
-
-      if (blocked) {
-        if (!is_blocked) {
-          new_start = slope_r;
-        } else {
-          blocked = false;
-          start = new_start;
-        }
-      } else if (!is_blocked && i < range) {
-        blocked = true;
-        fov_shadowcast_rec(map, mapsize, visblocking, lightmap, range, src,
-                           i + 1, start, slope_l, xx, xy, yx, yy);
-        new_start = slope_r;
+  return t;
+}
+
+static fov_table* fov_table_find(fov_table* t, const i32 range) {
+  while (t != NULL && t->range != range) t = t->next;
+  return t;
+}
+
+/* Returns the table of `range`, building it on first use */
+static const fov_table* fov_table_get(const i32 range) {
+  fov_table* t;
+  fov_table* expected = NULL;
+
+  if (range > FOV_TABLE_RANGE_MAX) {
+    /* Few large ranges are used, so the list stays short */
+    expected = __atomic_load_n(&fov_tables_large, __ATOMIC_ACQUIRE);
+    t = fov_table_find(expected, range);
+    if (t != NULL) return t;
+
+    t = fov_table_new(range);
+    for (;;) {
+      fov_table* other;
+
+      t->next = expected;
+      if (__atomic_compare_exchange_n(&fov_tables_large, &expected, t, false,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return t;
+      }
+      /* Another thread pushed a table, maybe of the same range */
+      other = fov_table_find(expected, range);
+      if (other != NULL) {
+        free(t);
+        return other;
       }
     }
+  }
+
+  t = __atomic_load_n(&fov_tables[range], __ATOMIC_ACQUIRE);
+  if (t != NULL) return t;
 
-    if (blocked) break;
+  /* Another thread may be building the same table, the first one wins */
+  t = fov_table_new(range);
+  if (!__atomic_compare_exchange_n(&fov_tables[range], &expected, t, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(t);
+    t = expected;
   }
+  return t;
 }
 
-/* http://www.roguebasin.com/index.php?title=FOV_using_recursive_shadowcasting
- */
-void fov_shadowcast(const void* map, const v2_i32 mapsize,
-                    bool (*visblocking)(const void*), i32* lightmap,
-                    const i32 range, const v2_i32 src) {
+/* returnvalue: true if light passes through the tile at (x, y), which must be
+ * inside the map */
+static inline bool fov_transparent(const fov_opacity* opacity, const i32 x,
+                                   const i32 y) {
+  const u8* row = (const u8*)opacity->data + (usize)y * opacity->stride;
+
+  switch (opacity->type) {
+  case FOV_OPACITY_BITS:
+    return !((row[x >> 3] >> (x & 7)) & 1);
+  case FOV_OPACITY_BYTES:
+    return row[(usize)x * opacity->elem_size] == 0;
+  case FOV_OPACITY_CALLBACK:
+  default:
+    return opacity->visblocking(row + (usize)x * opacity->elem_size);
+  }
+}
+
+static void fov_shadowcast_octant(const fov_opacity* opacity,
+                                  const v2_i32 mapsize, i32* lightmap,
+                                  const fov_table* table,
+                                  const v2_i32 src, Stack* rows, const i8 xx,
+                                  const i8 xy, const i8 yx, const i8 yy) {
+  const i32 range = table->range;
+  fov_row r = {.row = 1, .start = 1.0f, .end = 0.0f};
+  fov_row* top;
+
+  stack_push(rows, &r);
+
+  /* Rows are scanned one run of slopes at a time. Each blocked run pushes
+   * the part of the next row it leaves visible. */
+  while ((top = stack_pop(rows)) != NULL) {
+    f32 start, end, new_start;
 
+    /* `top` points into the stack, which pushing may move */
+    r = *top;
+    start = r.start;
+    end = r.end;
+    new_start = start;
+
+    if (start < end) continue;
+
+    for (i32 i = r.row; i <= range; i++) {
+      const fov_cell* cells = &table->cells[fov_cell_index(i, 0) - i];
+      const i32 dy = -i;
+      bool blocked = false;
+
+      for (i32 dx = -i; dx <= 0; dx++) {
+        const fov_cell* c = &cells[dx + i];
+        const i32 mapx = src.x + dx * xx + dy * xy;
+        const i32 mapy = src.y + dx * yx + dy * yy;
+
+        if (start < c->slope_r) continue;
+        if (end > c->slope_l) break;
+
+        const bool inside =
+            mapx >= 0 && mapx < mapsize.x && mapy >= 0 && mapy < mapsize.y;
+
+        if (inside && c->light != FOV_OUT_OF_RANGE) {
+          /* set as visible */
+          lightmap[mapy * mapsize.x + mapx] =
+              MAX(lightmap[mapy * mapsize.x + mapx], c->light);
+        }
+
+        /* Tiles outside the map block light */
+        const bool transparent =
+            inside && fov_transparent(opacity, mapx, mapy);
+
+        if (blocked) {
+          if (!transparent) {
+            new_start = c->slope_r;
+          } else {
+            blocked = false;
+            start = new_start;
+          }
+        } else if (!transparent && i < range) {
+          fov_row next = {.row = i + 1, .start = start, .end = c->slope_l};
+          blocked = true;
+          stack_push(rows, &next);
+          new_start = c->slope_r;
+        }
+      }
+
+      if (blocked) break;
+    }
+  }
+}
+
+/* Lights the tiles visible from `src`, but not `src` itself. `rows` is scratch
+ * space, so it can be reused from one source to the next. */
+static void fov_shadowcast_octants(const fov_opacity* opacity,
+                                   const v2_i32 mapsize, i32* lightmap,
+                                   const i32 range, const v2_i32 src,
+                                   Stack* rows) {
   const i8 m[4][8] = {
       {1, 0, 0, -1, -1, 0, 0, 1},
       {0, 1, -1, 0, 0, -1, 1, 0},
       {0, 1, 1, 0, 0, -1, -1, 0},
       {1, 0, 0, 1, -1, 0, 0, -1},
   };
+  const fov_table* table;
 
+  if (range <= 0) return;
+
+  table = fov_table_get(range);
   for (i32 oct = 0; oct < 8; oct++) {
-    fov_shadowcast_rec(map, mapsize, visblocking, lightmap, range, src, 1, 1.0,
-                       0.0, m[0][oct], m[1][oct], m[2][oct], m[3][oct]);
+    fov_shadowcast_octant(opacity, mapsize, lightmap, table, src, rows,
+                          m[0][oct], m[1][oct], m[2][oct], m[3][oct]);
   }
+}
+
+/* http://www.roguebasin.com/index.php?title=FOV_using_recursive_shadowcasting
+ */
+void fov_shadowcast_ex(const fov_opacity* opacity, const v2_i32 mapsize,
+                       i32* lightmap, const i32 range, const v2_i32 src) {
+  Stack rows = stack_new_ex(sizeof(fov_row), 64);
+
+  fov_shadowcast_octants(opacity, mapsize, lightmap, range, src, &rows);
+  stack_free(&rows);
 
   /* The center is the most lit square */
   lightmap[src.y * mapsize.x + src.x] = range;
 }
+
+/* A call to `fov_lightmap_multi`. Sources are handed out one at a time to
+ * its workers, as their cost varies a lot with range and walls. */
+typedef struct fov_job {
+  const fov_opacity* opacity;
+  v2_i32 mapsize;
+  const v2_i32* sources;
+  const i32* ranges;
+  usize n;
+  usize next; /* index of the next source to light */
+} fov_job;
+
+typedef struct fov_worker {
+  fov_job* job;
+  i32* lightmap;
+  bool clear;  /* `lightmap` is uninitialized, and cleared first */
+  usize index; /* 0 is the calling thread */
+  u64 seen;    /* last `fov_pool.job` this worker woke up for */
+} fov_worker;
+
+/* Threads of `fov_lightmap_multi`, kept from one call to the next. Worker
+ * t > 0 runs on `threads[t - 1]` and lights `lightmaps + (t - 1) * len`. */
+static struct {
+  SDL_mutex* lock;
+  SDL_cond* wake; /* a job was posted, or the pool is stopping */
+  SDL_cond* done; /* the last thread of a job finished */
+  SDL_Thread* threads[FOV_THREADS_MAX - 1];
+  fov_worker workers[FOV_THREADS_MAX];
+  usize started;
+  usize active;  /* workers of the current job, the calling thread included */
+  usize pending; /* threads still lighting the current job */
+  u64 job;       /* bumped for every job */
+  bool stop;
+  i32* lightmaps;
+  usize lightmaps_size; /* in tiles */
+} fov_pool;
+
+static void fov_worker_run(fov_worker* w) {
+  fov_job* job = w->job;
+  const usize len = (usize)job->mapsize.x * job->mapsize.y;
+  Stack rows = stack_new_ex(sizeof(fov_row), 64);
+  usize i;
+
+  if (w->clear) {
+    for (i = 0; i < len; i++) w->lightmap[i] = FOV_OUT_OF_RANGE;
+  }
+
+  while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n) {
+    const v2_i32 src = job->sources[i];
+    i32* center = &w->lightmap[src.y * job->mapsize.x + src.x];
+
+    fov_shadowcast_octants(job->opacity, job->mapsize, w->lightmap,
+                           job->ranges[i], src, &rows);
+    *center = MAX(*center, job->ranges[i]);
+  }
+
+  stack_free(&rows);
+}
+
+static int fov_pool_thread(void* data) {
+  fov_worker* w = data;
+
+  SDL_LockMutex(fov_pool.lock);
+  for (;;) {
+    while (!fov_pool.stop && fov_pool.job == w->seen) {
+      SDL_CondWait(fov_pool.wake, fov_pool.lock);
+    }
+    if (fov_pool.stop) break;
+
+    w->seen = fov_pool.job;
+    if (w->index >= fov_pool.active) continue;
+
+    SDL_UnlockMutex(fov_pool.lock);
+    fov_worker_run(w);
+    SDL_LockMutex(fov_pool.lock);
+
+    if (--fov_pool.pending == 0) SDL_CondSignal(fov_pool.done);
+  }
+  SDL_UnlockMutex(fov_pool.lock);
+  return 0;
+}
+
+/* Starts threads until `threads` are running, and makes room for their
+ * lightmaps of `len` tiles.
+ * returnvalue: the number of threads that can take part in a job */
+static usize fov_pool_start(const usize threads, const usize len) {
+  if (fov_pool.lock == NULL) {
+    fov_pool.lock = SDL_CreateMutex();
+    fov_pool.wake = SDL_CreateCond();
+    fov_pool.done = SDL_CreateCond();
+    if (fov_pool.lock == NULL || fov_pool.wake == NULL ||
+        fov_pool.done == NULL) {
+      WARN("Failed to create fov worker pool: %s", SDL_GetError());
+      fov_threads_stop();
+      return 0;
+    }
+  }
+
+  while (fov_pool.started < threads) {
+    fov_worker* w = &fov_pool.workers[fov_pool.started + 1];
+    SDL_Thread* t;
+
+    w->index = fov_pool.started + 1;
+    w->seen = fov_pool.job;
+    t = SDL_CreateThread(fov_pool_thread, "fov_worker", w);
+    if (t == NULL) {
+      WARN("Failed to start fov worker: %s", SDL_GetError());
+      break;
+    }
+    fov_pool.threads[fov_pool.started++] = t;
+  }
+
+  if (fov_pool.lightmaps_size < threads * len) {
+    i32* lightmaps = realloc(fov_pool.lightmaps, threads * len * sizeof(i32));
+    if (lightmaps == NULL) {
+      WARN("Failed to allocate fov lightmaps, lighting on a single thread");
+      return 0;
+    }
+    fov_pool.lightmaps = lightmaps;
+    fov_pool.lightmaps_size = threads * len;
+  }
+
+  return MIN(fov_pool.started, threads);
+}
+
+void fov_threads_stop(void) {
+  if (fov_pool.lock != NULL) {
+    SDL_LockMutex(fov_pool.lock);
+    fov_pool.stop = true;
+    SDL_CondBroadcast(fov_pool.wake);
+    SDL_UnlockMutex(fov_pool.lock);
+  }
+
+  for (usize t = 0; t < fov_pool.started; t++) {
+    SDL_WaitThread(fov_pool.threads[t], NULL);
+  }
+
+  if (fov_pool.done != NULL) SDL_DestroyCond(fov_pool.done);
+  if (fov_pool.wake != NULL) SDL_DestroyCond(fov_pool.wake);
+  if (fov_pool.lock != NULL) SDL_DestroyMutex(fov_pool.lock);
+  free(fov_pool.lightmaps);
+  memset(&fov_pool, 0, sizeof(fov_pool));
+}
+
+void fov_free(void) {
+  fov_threads_stop();
+
+  for (i32 r = 0; r <= FOV_TABLE_RANGE_MAX; r++) {
+    free(fov_tables[r]);
+    fov_tables[r] = NULL;
+  }
+  while (fov_tables_large != NULL) {
+    fov_table* next = fov_tables_large->next;
+    free(fov_tables_large);
+    fov_tables_large = next;
+  }
+}
+
+/* dst[i] = MAX(dst[i], src[i]) for `len` tiles */
+static void fov_lightmap_merge(i32* dst, const i32* src, const usize len) {
+  usize i = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+  for (; i + 4 <= len; i += 4) {
+    const __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+#if defined(__SSE4_1__)
+    const __m128i max = _mm_max_epi32(a, b);
+#else
+    const __m128i gt = _mm_cmpgt_epi32(a, b);
+    const __m128i max =
+        _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+#endif
+    _mm_storeu_si128((__m128i*)(dst + i), max);
+  }
+#endif
+
+  for (; i < len; i++) dst[i] = MAX(dst[i], src[i]);
+}
+
+void fov_lightmap_multi(const fov_opacity* opacity, const v2_i32 mapsize,
+                        const v2_i32* sources, const i32* ranges, usize n,
+                        i32* lightmap) {
+  const usize len = (usize)mapsize.x * mapsize.y;
+  const usize cores = SDL_GetCPUCount();
+  usize threads = n / FOV_SOURCES_PER_THREAD;
+  fov_job job = {
+      .opacity = opacity,
+      .mapsize = mapsize,
+      .sources = sources,
+      .ranges = ranges,
+      .n = n,
+      .next = 0,
+  };
+  /* The calling thread lights `lightmap` directly */
+  fov_worker self = {
+      .job = &job,
+      .lightmap = lightmap,
+      .clear = false,
+      .index = 0,
+      .seen = 0,
+  };
+
+  if (threads > cores) threads = cores;
+  if (threads > FOV_THREADS_MAX) threads = FOV_THREADS_MAX;
+
+  /* Few sources are not worth waking up other threads for */
+  if (threads > 1) threads = 1 + fov_pool_start(threads - 1, len);
+  if (threads <= 1) {
+    fov_worker_run(&self);
+    return;
+  }
+
+  SDL_LockMutex(fov_pool.lock);
+  for (usize t = 1; t < threads; t++) {
+    fov_worker* w = &fov_pool.workers[t];
+    w->job = &job;
+    w->lightmap = fov_pool.lightmaps + (t - 1) * len;
+    w->clear = true;
+  }
+  fov_pool.active = threads;
+  fov_pool.pending = threads - 1;
+  fov_pool.job++;
+  SDL_CondBroadcast(fov_pool.wake);
+  SDL_UnlockMutex(fov_pool.lock);
+
+  fov_worker_run(&self);
+
+  SDL_LockMutex(fov_pool.lock);
+  while (fov_pool.pending > 0) SDL_CondWait(fov_pool.done, fov_pool.lock);
+  SDL_UnlockMutex(fov_pool.lock);
+
+  for (usize t = 1; t < threads; t++) {
+    fov_lightmap_merge(lightmap, fov_pool.workers[t].lightmap, len);
+  }
+}
+
+void fov_shadowcast(const void* map, const v2_i32 mapsize,
+                    bool (*visblocking)(const void*), i32* lightmap,
+                    const i32 range, const v2_i32 src) {
+  /* sizeof(i32) is the size of enums */
+  /* -- unless the compiler doesn't follow standard behaviour */
+  const fov_opacity opacity = {
+      .type = FOV_OPACITY_CALLBACK,
+      .data = map,
+      .stride = sizeof(i32) * mapsize.x,
+      .elem_size = sizeof(i32),
+      .visblocking = visblocking,
+  };
+
+  fov_shadowcast_ex(&opacity, mapsize, lightmap, range, src);
+}
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <engine/fov_cache.h>
+#include <engine/hash.h>
+#include <engine/hashmap.h>
+#include <engine/logging.h>
+
+typedef struct fov_cache_key {
+  i32 x;
+  i32 y;
+  i32 range;
+  u32 slot; /* index of the entry holding the lightmap */
+} fov_cache_key;
+
+static int fov_cache_key_cmp(const fov_cache_key* a, const fov_cache_key* b) {
+  return a->x != b->x || a->y != b->y || a->range != b->range;
+}
+
+static u64 fov_cache_key_hash(const fov_cache_key* k) {
+  return hash_u64_seeded((u64)(u32)k->x << 32 | (u32)k->y, (u32)k->range);
+}
+
+DEFINE_HASHMAP(fov_cache_key, fov_cache_key_cmp, fov_cache_key_hash)
+
+typedef struct fov_cache_entry {
+  fov_cache_key key;
+  bool used;     /* `key` is in the hashmap */
+  u64 revision;  /* revision of the map `lightmap` is up to date with */
+  u64 last_used; /* `tick` of the last `fov_cache_get` returning it */
+  i32* lightmap;
+} fov_cache_entry;
+
+struct fov_cache {
+  fov_opacity opacity;
+  v2_i32 mapsize;
+  u64 revision; /* starts at 1, so entries at revision 0 are always stale */
+  u64 tick;
+  usize capacity;
+  fov_cache_entry* entries;
+  i32* lightmaps;
+  hashmap_fov_cache_key keys;
+};
+
+fov_cache* fov_cache_new(const fov_opacity* opacity, const v2_i32 mapsize,
+                         usize capacity) {
+  const usize len = (usize)mapsize.x * mapsize.y;
+  fov_cache* cache = malloc(sizeof(fov_cache));
+
+  if (capacity == 0) capacity = 1;
+
+  if (cache != NULL) {
+    cache->entries = calloc(capacity, sizeof(fov_cache_entry));
+    cache->lightmaps = malloc(capacity * len * sizeof(i32));
+  }
+  if (cache == NULL || cache->entries == NULL || cache->lightmaps == NULL) {
+    ERROR("Failed to allocate fov cache of %zu lightmaps", capacity);
+    exit(EXIT_FAILURE);
+  }
+
+  cache->opacity = *opacity;
+  cache->mapsize = mapsize;
+  cache->revision = 1;
+  cache->tick = 0;
+  cache->capacity = capacity;
+  for (usize i = 0; i < capacity; i++) {
+    cache->entries[i].lightmap = cache->lightmaps + i * len;
+  }
+  hashmap_fov_cache_key_init(&cache->keys, NULL);
+
+  return cache;
+}
+
+void fov_cache_free(fov_cache** cache) {
+  if (*cache == NULL) return;
+
+  hashmap_fov_cache_key_free(&(*cache)->keys);
+  free((*cache)->lightmaps);
+  free((*cache)->entries);
+  free(*cache);
+  *cache = NULL;
+}
+
+/* Returns the entry to compute a new lightmap in: a stale one if any, or the
+ * least recently used */
+static fov_cache_entry* fov_cache_evict(fov_cache* cache) {
+  fov_cache_entry* victim = &cache->entries[0];
+
+  for (usize i = 0; i < cache->capacity; i++) {
+    fov_cache_entry* e = &cache->entries[i];
+
+    if (!e->used || e->revision != cache->revision) {
+      victim = e;
+      break;
+    }
+    if (e->last_used < victim->last_used) victim = e;
+  }
+
+  if (victim->used) {
+    hashmap_fov_cache_key_delete(&cache->keys, &victim->key);
+    victim->used = false;
+  }
+  return victim;
+}
+
+const i32* fov_cache_get(fov_cache* cache, const v2_i32 src, const i32 range) {
+  const usize len = (usize)cache->mapsize.x * cache->mapsize.y;
+  fov_cache_key key = {.x = src.x, .y = src.y, .range = range, .slot = 0};
+  const fov_cache_key* found = hashmap_fov_cache_key_lookup(&cache->keys, &key);
+  fov_cache_entry* e;
+
+  if (found != NULL) {
+    e = &cache->entries[found->slot];
+    e->last_used = ++cache->tick;
+    if (e->revision == cache->revision) return e->lightmap;
+  } else {
+    e = fov_cache_evict(cache);
+    key.slot = e - cache->entries;
+    if (hashmap_fov_cache_key_insert(&cache->keys, &key) == NULL) {
+      ERROR("Failed to grow fov cache");
+      exit(EXIT_FAILURE);
+    }
+    e->key = key;
+    e->used = true;
+    e->last_used = ++cache->tick;
+  }
+
+  memset(e->lightmap, 0, len * sizeof(i32));
+  fov_shadowcast_ex(&cache->opacity, cache->mapsize, e->lightmap, range, src);
+  e->revision = cache->revision;
+  return e->lightmap;
+}
+
+void fov_cache_mark_dirty(fov_cache* cache, const v2_i32 tile) {
+  const u64 previous = cache->revision++;
+
+  /* Shadowcasting never looks further than `range` tiles along either axis,
+   * so the other lightmaps are still up to date */
+  for (usize i = 0; i < cache->capacity; i++) {
+    fov_cache_entry* e = &cache->entries[i];
+    const i32 dx = tile.x - e->key.x;
+    const i32 dy = tile.y - e->key.y;
+
+    if (!e->used || e->revision != previous) continue;
+    if (abs(dx) > e->key.range || abs(dy) > e->key.range) {
+      e->revision = cache->revision;
+    }
+  }
+}
+
+void fov_cache_invalidate(fov_cache* cache) { cache->revision++; }
+
+u64 fov_cache_revision(const fov_cache* cache) { return cache->revision; }
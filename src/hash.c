@@ -0,0 +1,115 @@
+#include <string.h>
+
+#include <engine/hash.h>
+
+/* wyhash, final version 4, by Wang Yi (public domain) */
+
+static const u64 hash_secret[4] = {
+    0xa0761d6478bd642fULL,
+    0xe7037ed1a0b428dbULL,
+    0x8ebc6af09c88c6dbULL,
+    0x589965cc75374cc3ULL,
+};
+
+/* Multiplies `*a` and `*b` to 128 bits, and stores the low and high half */
+static inline void hash_mum(u64* a, u64* b) {
+#ifdef __SIZEOF_INT128__
+  __extension__ typedef unsigned __int128 u128;
+  const u128 r = (u128)*a * *b;
+  *a = (u64)r;
+  *b = (u64)(r >> 64);
+#else
+  const u64 ha = *a >> 32, hb = *b >> 32;
+  const u64 la = (u32)*a, lb = (u32)*b;
+  const u64 rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  const u64 t = rl + (rm0 << 32);
+  u64 c = t < rl;
+  const u64 lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline u64 hash_mix(u64 a, u64 b) {
+  hash_mum(&a, &b);
+  return a ^ b;
+}
+
+/* Unaligned reads, memcpy compiles to a single load */
+static inline u64 hash_read64(const u8* p) {
+  u64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline u64 hash_read32(const u8* p) {
+  u32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Reads 1 to 3 bytes */
+static inline u64 hash_read3(const u8* p, usize k) {
+  return ((u64)p[0] << 16) | ((u64)p[k >> 1] << 8) | p[k - 1];
+}
+
+u64 hash_bytes_seeded(const void* data, usize len, u64 seed) {
+  const u8* p = data;
+  const u64* s = hash_secret;
+  u64 a, b;
+
+  seed ^= hash_mix(seed ^ s[0], s[1]);
+
+  if (len <= 16) {
+    if (len >= 4) {
+      /* Two overlapping reads at each end cover 4 to 16 bytes */
+      a = (hash_read32(p) << 32) | hash_read32(p + ((len >> 3) << 2));
+      b = (hash_read32(p + len - 4) << 32) |
+          hash_read32(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = hash_read3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    usize i = len;
+    if (i > 48) {
+      /* Three independent lanes keep the multipliers busy */
+      u64 see1 = seed, see2 = seed;
+      do {
+        seed = hash_mix(hash_read64(p) ^ s[1], hash_read64(p + 8) ^ seed);
+        see1 = hash_mix(hash_read64(p + 16) ^ s[2], hash_read64(p + 24) ^ see1);
+        see2 = hash_mix(hash_read64(p + 32) ^ s[3], hash_read64(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = hash_mix(hash_read64(p) ^ s[1], hash_read64(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = hash_read64(p + i - 16);
+    b = hash_read64(p + i - 8);
+  }
+
+  a ^= s[1];
+  b ^= seed;
+  hash_mum(&a, &b);
+  return hash_mix(a ^ s[0] ^ len, b ^ s[1]);
+}
+
+u64 hash_bytes(const void* data, usize len) {
+  return hash_bytes_seeded(data, len, HASH_SEED_DEFAULT);
+}
+
+u64 hash_str_seeded(const char* str, u64 seed) {
+  return hash_bytes_seeded(str, strlen(str), seed);
+}
+
+u64 hash_str(const char* str) {
+  return hash_bytes_seeded(str, strlen(str), HASH_SEED_DEFAULT);
+}
@@ -1,3 +1,23 @@
+#include <engine/hash.h>
 #include <engine/hashmap.h>
+#include <engine/logging.h>
 
-i32 lolhash(const usize s, i32 v) { return v % s; }
+i32 lolhash(const usize s, i32 v) { return hash_u64((u32)v) % s; }
+
+void hashmap_stats_log(const hashmap_stats* stats, const char* name) {
+  LOG("%s hashmap: %lu elements in %lu slots (load %.2f), %lu resizes", name,
+      stats->size, stats->capacity, stats->load_factor, stats->resizes);
+  LOG("  probe length: avg %.2f, max %lu", stats->avg_probe, stats->max_probe);
+
+  if (stats->lookups > 0) {
+    LOG("  %lu lookups: avg %.2f, max %lu probes", stats->lookups,
+        (f32)stats->probes / (f32)stats->lookups, stats->max_lookup_probes);
+  }
+
+  for (usize i = 0; i < HASHMAP_STATS_HIST; i++) {
+    if (stats->hist[i] == 0) continue;
+    LOG("  probe %2lu%s %10lu elements (%5.1f%%)", i + 1,
+        i == HASHMAP_STATS_HIST - 1 ? "+" : " ", stats->hist[i],
+        100.0f * (f32)stats->hist[i] / (f32)stats->size);
+  }
+}
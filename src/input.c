@@ -1,47 +1,46 @@
 #include <engine/dltools.h>
 #include <engine/input.h>
+#include <engine/intern.h>
 #include <engine/logging.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* Lazy binds, used internally. They are similar to BindAction and friends.
- * The only difference is that we set callbacks and such to NULL, but populate
- * the function name strings such that can be reloaded. */
-#define BindActionLazy(key, altkey, action_str)                                \
+ * The only difference is that we set callbacks and such to NULL, but keep the
+ * interned function names such that they can be reloaded. */
+#define BindActionLazy(key, altkey, action_id)                                 \
   (binding_t) {                                                                \
     .action = (action_t){.action =                                             \
                              {                                                 \
                                  .type = InputType_action,                     \
                                  .callback = NULL,                             \
-                                 .callback_str = strdup(action_str),           \
+                                 .callback_id = action_id,                     \
                              }},                                               \
     .scancode = key, .scancode_alt = altkey, .since_last_activation = 0        \
   }
 
-#define BindStateLazy(key, altkey, _activate_str, _deactivate_str)             \
+#define BindStateLazy(key, altkey, _activate_id, _deactivate_id)               \
   (binding_t) {                                                                \
     .action = (action_t){.state =                                              \
                              {                                                 \
                                  .type = InputType_state,                      \
                                  .activate = NULL,                             \
                                  .deactivate = NULL,                           \
-                                 .activate_str = strdup(_activate_str),        \
-                                 .deactivate_str = strdup(_deactivate_str),    \
+                                 .activate_id = _activate_id,                  \
+                                 .deactivate_id = _deactivate_id,              \
                              }},                                               \
     .scancode = key, .scancode_alt = altkey, .since_last_activation = 0        \
   }
 
+/* Callback names are interned, so bindings own no memory */
 void binding_t_free(binding_t* b) {
   switch (b->action.type) {
-  case InputType_error:
-    ERROR("Cannot free binding of type InputType_error");
-    break;
   case InputType_action:
-    free(b->action.action.callback_str);
+  case InputType_state:
     return;
 
-  case InputType_state:
-    free(b->action.state.activate_str);
-    free(b->action.state.deactivate_str);
+  case InputType_error:
+    ERROR("Cannot free binding of type InputType_error");
     break;
 
   case InputType_range:
@@ -66,14 +65,11 @@ bool binding_action_cmp(binding_t* restrict a, binding_t* restrict b) {
   if (t != b->action.type) return false;
   switch (t) {
   case InputType_action:
-    return !strcmp(a->action.action.callback_str,
-                   b->action.action.callback_str);
+    return a->action.action.callback_id == b->action.action.callback_id;
 
   case InputType_state:
-    return (!strcmp(a->action.state.activate_str,
-                    b->action.state.activate_str)) &&
-           (!strcmp(a->action.state.deactivate_str,
-                    b->action.state.deactivate_str));
+    return a->action.state.activate_id == b->action.state.activate_id &&
+           a->action.state.deactivate_id == b->action.state.deactivate_id;
 
   case InputType_range:  // fallthrough
   default:
@@ -156,63 +152,61 @@ action_t i_get_action(const i_ctx* restrict ctx, u32 time,
   return (action_t){.type = InputType_error};
 }
 
+/* Resolves the callback named `id` in `lib` into `*callback`. Many bindings
+ * share a callback, so every name is looked up once per refresh, in `cache`,
+ * which is indexed by id. Callbacks named "NULL" are left alone.
+ * returnvalue: false if the symbol was not found */
+static bool i_resolve_callback(void* lib, void** cache, intern_id id,
+                               input_callback_t** callback) {
+  /* Ids never change, so "NULL" is interned once */
+  static intern_id null_id = INTERN_NONE;
+
+  if (null_id == INTERN_NONE) null_id = intern("NULL");
+  if (id == null_id) return true;
+
+  if (cache[id] == NULL) {
+    cache[id] = dynamic_library_get_symbol(lib, intern_str(id));
+    if (cache[id] == NULL) {
+      ERROR("Failed to get binding for %s: %s", intern_str(id),
+            dynamic_library_get_error());
+      return false;
+    }
+  }
+
+  *callback = (input_callback_t*)cache[id];
+  return true;
+}
+
 bool state_refresh_input_ctx(void* lib, i_ctx** ctx, usize ctx_len) {
+  void** cache;
+  bool ok = true;
+
   if (ctx == NULL) return true;
   if (ctx_len > 0 && ctx[0] == NULL) return false;
   if (lib == NULL) return false;
 
-  for (usize c = 0; c < ctx_len; c++) {
+  cache = calloc(intern_count() + 1, sizeof(void*));
+  if (cache == NULL) {
+    ERROR("Failed to allocate the symbol cache");
+    return false;
+  }
+
+  for (usize c = 0; ok && c < ctx_len; c++) {
     LOG("ctx[%d]->len = %d", c, ctx[c]->len);
-    for (isize b = 0; b < ctx[c]->len; b++) {
-      switch (ctx[c]->bindings[b].action.type) {
+    for (isize b = 0; ok && b < ctx[c]->len; b++) {
+      action_t* a = &ctx[c]->bindings[b].action;
+      switch (a->type) {
       case InputType_error:
         break;
       case InputType_action:
-        if (strcmp("NULL", ctx[c]->bindings[b].action.action.callback_str) !=
-            0) {
-
-          ctx[c]->bindings[b].action.action.callback =
-              (input_callback_t*)dynamic_library_get_symbol(
-                  lib, ctx[c]->bindings[b].action.action.callback_str);
-
-          if (ctx[c]->bindings[b].action.action.callback == NULL) {
-            ERROR("Failed to get binding for %s: %s",
-                  ctx[c]->bindings[b].action.action.callback_str,
-                  dynamic_library_get_error());
-            return false;
-          }
-        }
+        ok = i_resolve_callback(lib, cache, a->action.callback_id,
+                                &a->action.callback);
         break;
       case InputType_state:
-        if (strcmp("NULL", ctx[c]->bindings[b].action.state.activate_str) !=
-            0) {
-
-          ctx[c]->bindings[b].action.state.activate =
-              (input_callback_t*)dynamic_library_get_symbol(
-                  lib, ctx[c]->bindings[b].action.state.activate_str);
-
-          if (ctx[c]->bindings[b].action.state.activate == NULL) {
-            ERROR("Failed to get binding for %s: %s",
-                  ctx[c]->bindings[b].action.state.activate_str,
-                  dynamic_library_get_error());
-            return false;
-          }
-        }
-
-        if (strcmp("NULL", ctx[c]->bindings[b].action.state.deactivate_str) !=
-            0) {
-
-          ctx[c]->bindings[b].action.state.deactivate =
-              (input_callback_t*)dynamic_library_get_symbol(
-                  lib, ctx[c]->bindings[b].action.state.deactivate_str);
-
-          if (ctx[c]->bindings[b].action.state.deactivate == NULL) {
-            ERROR("Failed to get binding for %s: %s",
-                  ctx[c]->bindings[b].action.state.deactivate_str,
-                  dynamic_library_get_error());
-            return false;
-          }
-        }
+        ok = i_resolve_callback(lib, cache, a->state.activate_id,
+                                &a->state.activate) &&
+             i_resolve_callback(lib, cache, a->state.deactivate_id,
+                                &a->state.deactivate);
         break;
       case InputType_range:
       default:
@@ -221,7 +215,8 @@ bool state_refresh_input_ctx(void* lib, i_ctx** ctx, usize ctx_len) {
     }
   }
 
-  return true;
+  free(cache);
+  return ok;
 }
 
 /* Make a lazy duplication of a binding. See comments on BindActionLazy and
@@ -247,12 +242,12 @@ i_ctx* i_ctx_dup(i_ctx** ctx, usize ctx_len) {
         break;
       case InputType_action:
         bb[cumsum] = BindActionLazy(b[i].scancode, b[i].scancode_alt,
-                                    strdup(b[i].action.action.callback_str));
+                                    b[i].action.action.callback_id);
         break;
       case InputType_state:
         bb[cumsum] = BindStateLazy(b[i].scancode, b[i].scancode_alt,
-                                   strdup(b[i].action.state.activate_str),
-                                   strdup(b[i].action.state.deactivate_str));
+                                   b[i].action.state.activate_id,
+                                   b[i].action.state.deactivate_id);
         break;
       case InputType_range:
       default:
@@ -275,17 +270,15 @@ binding_t* get_action(i_ctx* c, action_t* a) {
       return NULL;
 
     case InputType_action:
-      if (!strcmp(c->bindings[i].action.action.callback_str,
-                  a->action.callback_str)) {
+      if (c->bindings[i].action.action.callback_id == a->action.callback_id) {
         return &c->bindings[i];
       }
       break;
 
     case InputType_state:
-      if (!strcmp(c->bindings[i].action.state.activate_str,
-                  a->state.activate_str) &&
-          !strcmp(c->bindings[i].action.state.deactivate_str,
-                  a->state.deactivate_str)) {
+      if (c->bindings[i].action.state.activate_id == a->state.activate_id &&
+          c->bindings[i].action.state.deactivate_id ==
+              a->state.deactivate_id) {
         return &c->bindings[i];
       }
       break;
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <engine/hash.h>
+#include <engine/hashmap.h>
+#include <engine/intern.h>
+#include <engine/logging.h>
+#include <engine/memory.h>
+
+/* Address space reserved for the strings, committed as they are interned */
+#define INTERN_MEMORY_SIZE (16 * 1024 * 1024)
+
+typedef struct intern_entry {
+  const char* str;
+  usize len;
+  u64 hash;
+  intern_id id;
+} intern_entry;
+
+static int intern_entry_cmp(const intern_entry* a, const intern_entry* b) {
+  return a->hash != b->hash || a->len != b->len ||
+         memcmp(a->str, b->str, a->len) != 0;
+}
+
+static u64 intern_entry_hash(const intern_entry* e) { return e->hash; }
+
+DEFINE_HASHMAP(intern_entry, intern_entry_cmp, intern_entry_hash)
+
+static struct {
+  memory* strings; /* NULL until the first string is interned */
+  hashmap_intern_entry map;
+  const char** by_id; /* strings indexed by id, by_id[INTERN_NONE] is NULL */
+  usize len;
+  usize size;
+} intern_table;
+
+static void intern_init(void) {
+  intern_table.strings = memory_new_ex(INTERN_MEMORY_SIZE, MEMORY_RESERVE);
+  hashmap_intern_entry_init(&intern_table.map, NULL);
+
+  intern_table.size = 64;
+  intern_table.by_id = malloc(intern_table.size * sizeof(const char*));
+  if (intern_table.by_id == NULL) {
+    ERROR("Failed to allocate the intern table");
+    exit(EXIT_FAILURE);
+  }
+  intern_table.by_id[INTERN_NONE] = NULL;
+  intern_table.len = 1;
+}
+
+static intern_entry intern_key(const char* str, usize len) {
+  intern_entry key;
+  key.str = str;
+  key.len = len;
+  key.hash = hash_bytes(str, len);
+  key.id = INTERN_NONE;
+  return key;
+}
+
+intern_id intern_n(const char* str, usize len) {
+  intern_entry key;
+  const intern_entry* e;
+  char* copy;
+
+  if (intern_table.strings == NULL) intern_init();
+
+  key = intern_key(str, len);
+  e = hashmap_intern_entry_lookup(&intern_table.map, &key);
+  if (e != NULL) return e->id;
+
+  if (intern_table.len == intern_table.size) {
+    const char** by_id = realloc(intern_table.by_id, intern_table.size * 2 *
+                                                         sizeof(const char*));
+    if (by_id == NULL) {
+      ERROR("Failed to grow the intern table");
+      exit(EXIT_FAILURE);
+    }
+    intern_table.by_id = by_id;
+    intern_table.size *= 2;
+  }
+
+  copy = memory_allocate(intern_table.strings, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+
+  key.str = copy;
+  key.id = intern_table.len;
+  intern_table.by_id[intern_table.len++] = copy;
+
+  if (hashmap_intern_entry_insert(&intern_table.map, &key) == NULL) {
+    ERROR("Failed to intern \"%s\"", copy);
+    exit(EXIT_FAILURE);
+  }
+  return key.id;
+}
+
+intern_id intern(const char* str) { return intern_n(str, strlen(str)); }
+
+intern_id intern_find(const char* str) {
+  intern_entry key;
+  const intern_entry* e;
+
+  if (intern_table.strings == NULL) return INTERN_NONE;
+
+  key = intern_key(str, strlen(str));
+  e = hashmap_intern_entry_lookup(&intern_table.map, &key);
+  return e == NULL ? INTERN_NONE : e->id;
+}
+
+const char* intern_str(intern_id id) {
+  if (id >= intern_table.len) return NULL;
+  return intern_table.by_id[id];
+}
+
+usize intern_count(void) {
+  return intern_table.len == 0 ? 0 : intern_table.len - 1;
+}
@@ -2,30 +2,190 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__linux) || defined(__linux__) || defined(linux)
+#include <sys/mman.h>
+#include <unistd.h>
+#define MEMORY_HAVE_MMAP
+#endif
+
 #include <engine/logging.h>
 
 #include <engine/memory.h>
 
-memory* memory_new(usize max_size) {
+/* Below this many dirty bytes it is cheaper to memset than to madvise the
+ * pages away and fault them back in */
+#define MEMORY_RELEASE_THRESHOLD (1024 * 1024)
+
+/* Reserved memory is committed in steps of at least this many bytes */
+#define MEMORY_COMMIT_STEP (1024 * 1024)
+
+memory* memory_new(usize max_size) { return memory_new_ex(max_size, 0); }
+
+#ifdef MEMORY_HAVE_MMAP
+/* Maps `size` bytes of anonymous memory starting at a multiple of `align`.
+ * `size` and `align` must be multiples of the page size.
+ * returnvalue: NULL on failure */
+static void* memory_map(usize size, usize align, int prot, int mapflags) {
+  usize head, tail;
+  u8* data = mmap(NULL, size + align, prot, mapflags, -1, 0);
+
+  if (data == MAP_FAILED) return NULL;
+
+  /* Trim the excess on either side of the aligned range */
+  head = (align - (usize)data % align) % align;
+  tail = align - head;
+  if (head > 0) munmap(data, head);
+  if (tail > 0) munmap(data + head + size, tail);
+
+  return data + head;
+}
+#endif
+
+memory* memory_new_ex(usize max_size, u32 flags) {
   memory* m = malloc(sizeof(memory));
-  m->data = malloc(max_size);
+  m->data = NULL;
   m->size = max_size;
   m->pos = 0;
   m->free = max_size;
+  m->committed = max_size;
+  m->hwm = 0;
+  m->flags = 0;
+  m->stats = NULL;
+
+  /* Fresh anonymous pages are zeroed by the kernel on first touch, so there is
+   * no need to memset the block up front. */
+#ifdef MEMORY_HAVE_MMAP
+  {
+    const usize page = sysconf(_SC_PAGESIZE);
+    /* Huge pages can only back naturally aligned ranges */
+    const usize align =
+        (flags & MEMORY_HUGEPAGES) ? MEMORY_HUGEPAGE_SIZE : page;
+    const usize map_size = max_size + (align - max_size % align) % align;
+    int prot = PROT_READ | PROT_WRITE;
+    int mapflags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    if (flags & MEMORY_RESERVE) {
+      prot = PROT_NONE;
+      mapflags |= MAP_NORESERVE;
+    }
+
+    m->data = memory_map(map_size, align, prot, mapflags);
 
-  memset(m->data, 0, max_size);
+    if (m->data != NULL) {
+      m->flags |= MEMORY_MAPPED | (flags & MEMORY_RESERVE);
+      if (flags & MEMORY_RESERVE) m->committed = 0;
+
+      if (flags & MEMORY_HUGEPAGES) {
+#ifdef MADV_HUGEPAGE
+        if (madvise(m->data, map_size, MADV_HUGEPAGE) == 0) {
+          m->flags |= MEMORY_HUGEPAGES;
+        } else {
+          WARN("Transparent huge pages are unavailable, using regular pages");
+        }
+#else
+        WARN("Transparent huge pages are not supported, using regular pages");
+#endif
+      }
+    }
+  }
+#else
+  if (flags & MEMORY_RESERVE) {
+    WARN("Reserving memory is not supported on this platform");
+  }
+  if (flags & MEMORY_HUGEPAGES) {
+    WARN("Huge pages are not supported on this platform");
+  }
+#endif
+
+  if (m->data == NULL) {
+    /* Over-allocate so the start of the block can be cache line aligned */
+    u8* data = calloc(1, max_size + MEMORY_CACHE_LINE);
+    if (data != NULL) {
+      m->data = data + (MEMORY_CACHE_LINE - (usize)data % MEMORY_CACHE_LINE);
+    }
+  }
+
+  if (m->data == NULL) {
+    ERROR("Failed to allocate %lu bytes of memory", max_size);
+    exit(EXIT_FAILURE);
+  }
 
   return m;
 }
 
+/* Makes sure the first `end` bytes of a reserved block are usable.
+ * returnvalue: `false` if the pages could not be committed */
+static bool memory_commit(memory* mem, usize end) {
+#ifdef MEMORY_HAVE_MMAP
+  /* Commit whole huge pages, so they can actually be backed by one */
+  const usize page = (mem->flags & MEMORY_HUGEPAGES)
+                         ? (usize)MEMORY_HUGEPAGE_SIZE
+                         : (usize)sysconf(_SC_PAGESIZE);
+  usize new_committed = mem->committed + MEMORY_COMMIT_STEP;
+
+  if (new_committed < end) new_committed = end;
+  new_committed += (page - new_committed % page) % page;
+  if (new_committed > mem->size) new_committed = mem->size;
+
+  if (mprotect((u8*)mem->data + mem->committed,
+               new_committed - mem->committed,
+               PROT_READ | PROT_WRITE) != 0) {
+    ERROR("Failed to commit %lu bytes of reserved memory",
+          new_committed - mem->committed);
+    return false;
+  }
+
+  mem->committed = new_committed;
+  return true;
+#else
+  (void)mem;
+  (void)end;
+  return false;
+#endif
+}
+
+static void memory_stats_record(memory_stats* stats, usize pos, usize size,
+                                const char* tag) {
+  usize i = 0;
+
+  stats->bytes += size;
+  stats->allocations++;
+  if (pos > stats->peak) stats->peak = pos;
+
+  while (i < stats->tags_len && stats->tags[i].tag != tag &&
+         (tag == NULL || stats->tags[i].tag == NULL ||
+          strcmp(stats->tags[i].tag, tag) != 0)) {
+    i++;
+  }
+
+  if (i == stats->tags_len) {
+    if (stats->tags_len < MEMORY_STATS_TAGS) {
+      stats->tags[stats->tags_len++].tag = tag;
+    } else {
+      i = MEMORY_STATS_TAGS - 1;
+    }
+  }
+
+  stats->tags[i].bytes += size;
+  stats->tags[i].count++;
+}
+
 /* Returns a pointer to the allocated data */
 void* memory_allocate(memory* mem, usize size) {
+  return memory_allocate_tagged(mem, size, NULL);
+}
+
+void* memory_allocate_tagged(memory* mem, usize size, const char* tag) {
   void* data = NULL;
 
-  if (mem->pos + size <= mem->size) {
+  if (mem->pos + size <= mem->size &&
+      (mem->pos + size <= mem->committed ||
+       memory_commit(mem, mem->pos + size))) {
     data = (void*)((usize)mem->data + mem->pos);
     mem->pos += size;
     mem->free -= size;
+    if (mem->pos > mem->hwm) mem->hwm = mem->pos;
+    if (mem->stats != NULL) memory_stats_record(mem->stats, mem->pos, size, tag);
   } else {
     ERROR("Trying to allocate %lu in a %lu sized memory block", size,
           mem->size);
@@ -36,11 +196,28 @@ void* memory_allocate(memory* mem, usize size) {
   return data;
 }
 
+void* memory_allocate_aligned(memory* mem, usize size, usize align) {
+  usize pad;
+
+  if (align == 0 || (align & (align - 1)) != 0) {
+    ERROR("Alignment %lu is not a power of two", align);
+    exit(EXIT_FAILURE);
+  }
+
+  pad = (align - ((usize)mem->data + mem->pos) % align) & (align - 1);
+
+  return (u8*)memory_allocate(mem, pad + size) + pad;
+}
+
 memory memory_init(void* data, usize size) {
   memory m = {0};
   m.data = data;
   m.size = size;
   m.free = 0;
+  m.committed = size;
+  m.stats = NULL;
+  /* We know nothing about the contents, so the first clear zeroes it all */
+  m.hwm = size;
   return m;
 }
 
@@ -55,8 +232,149 @@ void memory_free(memory* mem, usize size) {
 }
 
 void memory_clear(memory* mem) {
+  usize dirty = mem->hwm;
+
   mem->pos = 0;
   mem->free = mem->size;
-  /* Reset the memory? */
-  memset(mem->data, 0, mem->size);
+  mem->hwm = 0;
+
+#ifdef MEMORY_HAVE_MMAP
+  if ((mem->flags & MEMORY_MAPPED) && dirty >= MEMORY_RELEASE_THRESHOLD) {
+    const usize page = sysconf(_SC_PAGESIZE);
+    const usize whole = dirty - (dirty % page);
+
+    /* Private anonymous pages read back as zero after MADV_DONTNEED */
+    if (madvise(mem->data, whole, MADV_DONTNEED) == 0) {
+      memset((u8*)mem->data + whole, 0, dirty - whole);
+      return;
+    }
+    WARN("madvise failed, falling back to memset");
+  }
+#endif
+
+  /* Reset the memory */
+  memset(mem->data, 0, dirty);
+}
+
+void memory_reset(memory* mem) {
+  mem->pos = 0;
+  mem->free = mem->size;
+}
+
+memory_mark_t memory_mark(const memory* mem) {
+  memory_mark_t mark = {.pos = mem->pos};
+  return mark;
+}
+
+void memory_rewind(memory* mem, memory_mark_t mark) {
+  if (mark.pos > mem->pos) {
+    ERROR("Rewinding to %lu, but only %lu bytes are allocated", mark.pos,
+          mem->pos);
+    exit(EXIT_FAILURE);
+  }
+  mem->free += mem->pos - mark.pos;
+  mem->pos = mark.pos;
+}
+
+/* Stats */
+
+void memory_stats_enable(memory* mem) {
+  if (mem->stats != NULL) return;
+
+  mem->stats = calloc(1, sizeof(memory_stats));
+  if (mem->stats == NULL) {
+    ERROR("Failed to allocate memory stats");
+    return;
+  }
+  mem->stats->peak = mem->pos;
+}
+
+const memory_stats* memory_stats_get(const memory* mem) { return mem->stats; }
+
+void memory_stats_reset(memory* mem) {
+  if (mem->stats == NULL) return;
+  memset(mem->stats, 0, sizeof(memory_stats));
+  mem->stats->peak = mem->pos;
+}
+
+void memory_stats_log(const memory* mem, const char* name) {
+  const memory_stats* stats = mem->stats;
+
+  if (stats == NULL) {
+    WARN("No stats enabled for %s memory", name);
+    return;
+  }
+
+  LOG("%s memory: peak %lu / %lu bytes (%.2f%%), "
+      "%lu allocations, %lu bytes total",
+      name, stats->peak, mem->size,
+      100.0f * (f32)stats->peak / (f32)mem->size, stats->allocations,
+      stats->bytes);
+
+  for (usize i = 0; i < stats->tags_len; i++) {
+    LOG("  %-40s %10lu bytes %8lu allocations",
+        stats->tags[i].tag != NULL ? stats->tags[i].tag : "(untagged)",
+        stats->tags[i].bytes, stats->tags[i].count);
+  }
+}
+
+/* Pools */
+
+/* Bytes carved out of the memory block when a size class runs dry */
+#define MEMORY_POOL_BATCH_SIZE 4096
+
+/* Free objects store the pointer to the next free object in themselves */
+typedef struct memory_pool_node {
+  struct memory_pool_node* next;
+} memory_pool_node;
+
+/* returnvalue: size class of `size`, `MEMORY_POOL_CLASSES` if it's too big */
+static usize memory_pool_class(usize size) {
+  usize c = 0;
+  while (c < MEMORY_POOL_CLASSES && ((usize)MEMORY_POOL_MIN << c) < size) c++;
+  return c;
+}
+
+memory_pool memory_pool_new(memory* mem) {
+  memory_pool pool = {.mem = mem};
+  for (usize c = 0; c < MEMORY_POOL_CLASSES; c++) pool.free_list[c] = NULL;
+  return pool;
+}
+
+void* memory_pool_allocate(memory_pool* pool, usize size) {
+  const usize c = memory_pool_class(size);
+  memory_pool_node* node;
+
+  if (c == MEMORY_POOL_CLASSES) {
+    return memory_allocate_aligned(pool->mem, size, MEMORY_POOL_MIN);
+  }
+
+  if (pool->free_list[c] == NULL) {
+    /* Carve a batch of objects and thread them onto the free list */
+    const usize obj_size = (usize)MEMORY_POOL_MIN << c;
+    const usize n = MEMORY_POOL_BATCH_SIZE / obj_size;
+    u8* batch = memory_allocate_aligned(pool->mem, n * obj_size,
+                                        MEMORY_POOL_MIN);
+
+    for (usize i = 0; i < n; i++) {
+      node = (memory_pool_node*)(batch + i * obj_size);
+      node->next = i + 1 < n ? (memory_pool_node*)(batch + (i + 1) * obj_size)
+                             : NULL;
+    }
+    pool->free_list[c] = batch;
+  }
+
+  node = pool->free_list[c];
+  pool->free_list[c] = node->next;
+  return node;
+}
+
+void memory_pool_free(memory_pool* pool, void* ptr, usize size) {
+  const usize c = memory_pool_class(size);
+  memory_pool_node* node = ptr;
+
+  if (ptr == NULL || c == MEMORY_POOL_CLASSES) return;
+
+  node->next = pool->free_list[c];
+  pool->free_list[c] = node;
 }
@@ -1,17 +1,24 @@
 #include <engine/logging.h>
 #include <engine/stack.h>
 #include <stdlib.h>
+#include <string.h>
 
 Stack stack_new_ex(const usize element_size, const usize size) {
+  const allocator a = allocator_malloc();
+  return stack_new_with_allocator(element_size, size, &a);
+}
+
+Stack stack_new_with_allocator(const usize element_size, const usize size,
+                               const allocator* alloc) {
   Stack s = {
       .head = 0,
       .elem_size = element_size,
-      .size = element_size * size,
-      .chunk_size = element_size * size,
+      .size = element_size * (size > 0 ? size : 1),
       .data = NULL,
+      .alloc = *alloc,
   };
 
-  s.data = (void*)calloc(element_size, size);
+  s.data = allocator_alloc(alloc, s.size);
   return s;
 }
 
@@ -21,7 +28,7 @@ Stack stack_new(const usize element_size) {
 
 void stack_free(Stack* s) {
   if (s->data == NULL) return;
-  free(s->data);
+  allocator_dealloc(&s->alloc, s->data, s->size);
   s->data = NULL;
 }
 
@@ -30,28 +37,53 @@ void* stack_pop(Stack* s) {
   return (u8*)s->data + (--(s->head) * s->elem_size);
 }
 
+void stack_reserve(Stack* s, const usize n) {
+  const usize needed = (s->head + n) * s->elem_size;
+  usize new_size = s->size;
+  void* ptr;
+
+  if (needed <= s->size) return;
+
+  /* Grow geometrically, so pushing is amortized O(1) */
+  while (new_size < needed) new_size *= 2;
+
+  ptr = allocator_realloc(&s->alloc, s->data, s->size, new_size);
+  if (ptr == NULL) {
+    ERROR("Failed to resize memory for stack");
+    exit(EXIT_FAILURE);
+  }
+  s->data = ptr;
+  s->size = new_size;
+}
+
 void stack_push(Stack* s, void* elem) {
   if (elem == NULL) {
     WARN("%s received a nullptr", __func__);
     return;
   }
-  if (s->head > 0 && s->head * s->elem_size >= s->size) {
-    WARN("Allocating more stack memory");
-    /* Reallocate more memory and update size */
-    void* ptr = realloc(s->data, s->size + s->chunk_size);
-    if (ptr == NULL) {
-      ERROR("Failed to resize memory for stack");
-      exit(EXIT_FAILURE);
-    }
-    s->data = ptr;
-    // memset((void*)((u64)s->data + (s->size - s->elem_size)), 0,
-    // s->chunk_size);
-    s->size += s->chunk_size;
-  }
+  if ((s->head + 1) * s->elem_size > s->size) stack_reserve(s, 1);
+
   memcpy((u8*)s->data + s->head * s->elem_size, elem, s->elem_size);
   s->head++;
 }
 
+void stack_push_n(Stack* s, const void* elems, const usize n) {
+  if (elems == NULL) {
+    WARN("%s received a nullptr", __func__);
+    return;
+  }
+  stack_reserve(s, n);
+
+  memcpy((u8*)s->data + s->head * s->elem_size, elems, n * s->elem_size);
+  s->head += n;
+}
+
+void* stack_pop_n(Stack* s, const usize n) {
+  if ((usize)s->head < n) return NULL;
+  s->head -= n;
+  return (u8*)s->data + s->head * s->elem_size;
+}
+
 void* stack_peek(Stack* s) {
   if (s->head <= 0) return NULL; /* Empty stack */
   return (u8*)s->data + ((s->head - 1) * s->elem_size);
@@ -60,23 +92,24 @@ void* stack_peek(Stack* s) {
 isize stack_size(const Stack* s) { return s->head; }
 
 void stack_swap(Stack* s, Stack* t) {
-  if (s->size > t->size) {
-    t->data = realloc(t->data, s->size);
-  } else if (t->size > s->size) {
-    s->data = realloc(s->data, t->size);
-  }
-  void* tmp = malloc(s->size);
-  if (tmp == NULL) {
-    ERROR("Failed to allocate memory for stack swapping!");
-    exit(EXIT_FAILURE);
-  }
-  isize shead = s->head;
+  isize head = s->head;
+  usize size = s->size;
+  void* data = s->data;
+  allocator alloc = s->alloc;
 
-  memcpy(tmp, s->data, s->size);
-  memcpy(s->data, t->data, t->size);
-  memcpy(t->data, tmp, s->size);
+  if (s->elem_size != t->elem_size) {
+    ERROR("Cannot swap stacks with different element sizes (%lu and %lu)",
+          s->elem_size, t->elem_size);
+    return;
+  }
 
   s->head = t->head;
-  t->head = shead;
-  free(tmp);
+  s->size = t->size;
+  s->data = t->data;
+  s->alloc = t->alloc;
+
+  t->head = head;
+  t->size = size;
+  t->data = data;
+  t->alloc = alloc;
 }
@@ -51,11 +51,15 @@ const char* StateTypeStr[] = {
 
 void binding_t_free(binding_t* b);
 
+/* The state is the first allocation after a clear, and memory blocks are cache
+ * line aligned, so the state ends up at `mem->data` which is what the update
+ * and free functions are handed. */
 void State_init(StateType type, memory* mem) {
   switch (type) {
 #define State(name)                                                            \
   case (STATE_##name): {                                                       \
-    name##_init(memory_allocate(mem, sizeof(name##_state)));                   \
+    name##_init(memory_allocate_aligned(mem, sizeof(name##_state),             \
+                                        MEMORY_CACHE_LINE));                   \
     break;                                                                     \
   }
 #include <states/list_of_states.h>
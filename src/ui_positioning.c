@@ -17,6 +17,10 @@ static i32 DEFAULT_MARGIN = 0;
  * reposition the elements if needed be. */
 struct btree* GLOBAL_UIROOTS = NULL;
 
+/* Allocator for ui elements, see `ui_set_allocator` */
+static allocator UI_ALLOCATOR;
+static bool UI_ALLOCATOR_SET = false;
+
 extern Platform* GLOBAL_PLATFORM;
 
 const char* uitype_str[] = {
@@ -41,16 +45,20 @@ const char* constraint_str[] = {
     [ui_constraint_bottom] = "ui_constraint_bottom",
 };
 
-static i32 pointer_cmp(const void* a, const void* b) {
-  const u64* x = a;
-  const u64* y = b;
-  /* We just use the address as index */
-  return *x - *y;
+/* We just use the address as index */
+DEFINE_BTREE(u64, BTREE_LT)
+
+static const allocator* ui_allocator(void) {
+  if (!UI_ALLOCATOR_SET) {
+    UI_ALLOCATOR = allocator_malloc();
+    UI_ALLOCATOR_SET = true;
+  }
+  return &UI_ALLOCATOR;
 }
 
-static void pointer_print(const void* a) {
-  const u64* t = a;
-  printf("%lx\n", *t);
+void ui_set_allocator(const allocator* a) {
+  UI_ALLOCATOR = *a;
+  UI_ALLOCATOR_SET = true;
 }
 
 void ui_rearrange(UITree* root, v2_i32 ppos, v2_i32 psize);
@@ -107,21 +115,24 @@ i32 ui_size_to_pixel(ui_size s) {
 void ui_add(UITree* t) {
 
   if (GLOBAL_UIROOTS == NULL) {
-    GLOBAL_UIROOTS = btree_new(sizeof(void*), 16, &pointer_cmp);
+    GLOBAL_UIROOTS = btree_u64_new_ex(16, NULL, BTREE_PLUS);
   }
 
-  u64 tmp = (u64)t;
-  btree_insert(GLOBAL_UIROOTS, &tmp);
+  btree_u64_insert(GLOBAL_UIROOTS, (u64)t);
 }
 
 void clear_ui(void) {
-  UITree* t = NULL;
-  while ((t = btree_first(GLOBAL_UIROOTS)) != NULL) {
-    uitree_free(t);
-    if (!btree_delete(GLOBAL_UIROOTS, t)) {
+  u64* t = NULL;
+  while ((t = btree_u64_first(GLOBAL_UIROOTS)) != NULL) {
+    const u64 key = *t;
+    UITree* elem = (UITree*)key;
+    const enum uitype type = elem->type;
+
+    uitree_free(elem);
+    if (!btree_u64_delete(GLOBAL_UIROOTS, key)) {
       WARN("Failed deletion");
-      UITree* elem = (UITree*)t;
-      WARN("Failed to remove %s from global ui-table", uitype_str[elem->type]);
+      WARN("Failed to remove %s from global ui-table", uitype_str[type]);
+      break;
     }
   }
 }
@@ -162,7 +173,7 @@ UITree* ui_container_new_ex(Engine_color fg, Engine_color bg,
                             Engine_color border, bool direction,
                             struct List_ui_constraint* constraints) {
 
-  UITree* t = malloc(sizeof(UITree));
+  UITree* t = allocator_alloc(ui_allocator(), sizeof(UITree));
 
   t->container.type = uitype_container;
   t->container.visible = true;
@@ -201,7 +212,7 @@ UITree* ui_container(bool direction, struct List_ui_constraint* constraints) {
 
 UITree* ui_title(i32 font_id, const char* text,
                  struct List_ui_constraint* constraints) {
-  UITree_title* t = malloc(sizeof(UITree));
+  UITree_title* t = allocator_alloc(ui_allocator(), sizeof(UITree));
   t->type = uitype_title;
 
   t->x = -1;
@@ -231,7 +242,7 @@ UITree* ui_title(i32 font_id, const char* text,
 
 UITree* ui_text(i32 font_id, const char* text,
                 struct List_ui_constraint* constraints) {
-  UITree* t = malloc(sizeof(UITree));
+  UITree* t = allocator_alloc(ui_allocator(), sizeof(UITree));
   t->text.type = uitype_text;
 
   t->text.x = -1;
@@ -265,7 +276,7 @@ UITree* ui_text(i32 font_id, const char* text,
 
 UITree* ui_button(u64 id, i32 font_id, char* text,
                   struct List_ui_constraint* constraints) {
-  UITree_button* t = malloc(sizeof(UITree));
+  UITree_button* t = allocator_alloc(ui_allocator(), sizeof(UITree));
   t->type = uitype_button;
 
   t->enabled = true;
@@ -298,17 +309,19 @@ UITree* ui_button(u64 id, i32 font_id, char* text,
 void uitree_free(UITree* t) {
   switch (t->type) {
   case uitype_container:
-    if (t->container.children != NULL && t->container.children_len > 0) {
+    if (t->container.children != NULL) {
       for (usize i = 0; i < t->container.children_len; i++) {
         uitree_free(t->container.children[i]);
       }
-      free(t->container.children);
+      allocator_dealloc(ui_allocator(), t->container.children,
+                        t->container.children_size);
     }
+    allocator_dealloc(ui_allocator(), t, sizeof(UITree));
     break;
   case uitype_button:
   case uitype_title:
   case uitype_text:
-    free(t);
+    allocator_dealloc(ui_allocator(), t, sizeof(UITree));
     break;
   default:
     break;
@@ -824,7 +837,7 @@ void ui_resolve_constraints(void) {
     ui_rearrange((UITree*)*i, (v2_i32){0, 0},
                  GLOBAL_PLATFORM->window->windowsize);
   }
-  free(it);
+  btree_iter_t_free(GLOBAL_UIROOTS, &it);
 }
 
 void ui_container_attach(UITree* root, UITree* child) {
@@ -844,14 +857,16 @@ void ui_container_attach(UITree* root, UITree* child) {
 
   if (c->children == NULL) {
     /* Allocate space for children */
-    c->children = malloc(uitree_sz * size_increment);
+    c->children = allocator_alloc(ui_allocator(), uitree_sz * size_increment);
+    c->children_size = uitree_sz * size_increment;
 
   } else if ((c->children_len + 1) * uitree_sz >= c->children_size) {
     /* If there's not enough room for more children we will need to
      * reallocate some more memory */
-    c->children =
-        realloc(c->children, (c->children_len + size_increment) * uitree_sz);
-    c->children_size += size_increment * uitree_sz;
+    const usize new_size = c->children_size + size_increment * uitree_sz;
+    c->children = allocator_realloc(ui_allocator(), c->children,
+                                    c->children_size, new_size);
+    c->children_size = new_size;
   }
 
   /* Finally: attach the new element */
@@ -860,10 +875,9 @@ void ui_container_attach(UITree* root, UITree* child) {
   /* Since the child is no longer a part of the root-ui we can delete it from
    * the btree-mapping */
   {
-    u64 tmp = (u64)child;
-    if (!btree_delete(GLOBAL_UIROOTS, &tmp)) {
+    const u64 key = (u64)child;
+    if (!btree_u64_delete(GLOBAL_UIROOTS, key)) {
       WARN("Could not find child %p in global lookup table", child);
-      btree_print(GLOBAL_UIROOTS, &pointer_print);
     }
   }
 }
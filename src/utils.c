@@ -3,6 +3,7 @@
 
 #include <string.h>
 
+#include <engine/hash.h>
 #include <engine/logging.h>
 #include <engine/utils.h>
 
@@ -12,14 +13,7 @@ i32 int_lerp(f32 dt, i32 a, i32 b) {
   return ((f32)a * (1.0f - dt)) + ((f32)b * dt);
 }
 
-u32 hash(char* str) {
-  u32 sum = 0;
-  while (*str != '\0') {
-    sum ^= (*str) * 0xdeece66d + 0xb;
-    str++;
-  }
-  return sum;
-}
+u32 hash(char* str) { return (u32)hash_str(str); }
 
 /* Populates dstmap
  * on success: return pointer to dstmap
@@ -0,0 +1,120 @@
+/* Collision and throughput benchmark for engine/hash.h
+ *
+ * Compares `hash_str` with the string hash `hash` in utils.c used before it,
+ * on keys that only differ in a few characters, like most engine identifiers.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <engine/hash.h>
+
+#define NUM_KEYS (1 << 18)
+#define KEY_SIZE 32
+#define THROUGHPUT_BYTES (1 << 28)
+
+/* The previous `hash` of utils.c */
+static u64 hash_legacy(const char* str) {
+  u32 sum = 0;
+  while (*str != '\0') {
+    sum ^= (*str) * 0xdeece66d + 0xb;
+    str++;
+  }
+  return sum;
+}
+
+static u64 hash_current(const char* str) { return hash_str(str); }
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int u64_cmp(const void* a, const void* b) {
+  const u64 x = *(const u64*)a;
+  const u64 y = *(const u64*)b;
+  return (x > y) - (x < y);
+}
+
+/* Counts the keys whose 32 bit hash equals the one of another key, and the
+ * longest chain when the keys are spread over NUM_KEYS buckets by the low
+ * bits, as `DEFINE_HASHMAP` does. */
+static void collisions(const char* name, u64 (*f)(const char*),
+                       char (*keys)[KEY_SIZE], u64* hashes, u32* buckets) {
+  usize i, dups = 0;
+  u32 longest = 0;
+
+  memset(buckets, 0, NUM_KEYS * sizeof(u32));
+  for (i = 0; i < NUM_KEYS; i++) {
+    const u64 h = f(keys[i]);
+    hashes[i] = (u32)h;
+    buckets[h & (NUM_KEYS - 1)]++;
+  }
+
+  qsort(hashes, NUM_KEYS, sizeof(u64), u64_cmp);
+  for (i = 1; i < NUM_KEYS; i++) {
+    if (hashes[i] == hashes[i - 1]) dups++;
+  }
+  for (i = 0; i < NUM_KEYS; i++) {
+    if (buckets[i] > longest) longest = buckets[i];
+  }
+
+  printf("%-8s 32 bit collisions: %8zu  longest bucket: %6u\n", name,
+         (size_t)dups, longest);
+}
+
+static void throughput(usize len) {
+  const usize n = THROUGHPUT_BYTES / len;
+  u8* data = malloc(len);
+  u64 sink = 0;
+  double start, elapsed;
+  usize i;
+
+  for (i = 0; i < len; i++) data[i] = (u8)(i * 131);
+
+  start = now();
+  for (i = 0; i < n; i++) {
+    /* Vary the seed so the calls cannot be folded together */
+    sink += hash_bytes_seeded(data, len, i);
+  }
+  elapsed = now() - start;
+
+  printf("%6zu bytes: %8.1f MiB/s %8.1f Mhash/s (%016llx)\n", (size_t)len,
+         THROUGHPUT_BYTES / elapsed / (1 << 20), n / elapsed / 1e6,
+         (unsigned long long)sink);
+  free(data);
+}
+
+int main(void) {
+  static const usize lengths[] = {4, 8, 16, 32, 64, 256, 4096};
+  char(*keys)[KEY_SIZE] = malloc(NUM_KEYS * KEY_SIZE);
+  u64* hashes = malloc(NUM_KEYS * sizeof(u64));
+  u32* buckets = malloc(NUM_KEYS * sizeof(u32));
+  usize i;
+
+  if (keys == NULL || hashes == NULL || buckets == NULL) {
+    perror("could not allocate keys");
+    return EXIT_FAILURE;
+  }
+
+  puts("Keys like \"action_<n>\":");
+  for (i = 0; i < NUM_KEYS; i++) {
+    snprintf(keys[i], KEY_SIZE, "action_%zu", (size_t)i);
+  }
+  collisions("legacy", hash_legacy, keys, hashes, buckets);
+  collisions("hash_str", hash_current, keys, hashes, buckets);
+
+  puts("\nThroughput of hash_bytes:");
+  for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+    throughput(lengths[i]);
+  }
+
+  free(keys);
+  free(hashes);
+  free(buckets);
+  return EXIT_SUCCESS;
+}